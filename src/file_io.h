@@ -2,6 +2,11 @@
 // For more details see texto.h.
 
 #include "stdafx.h"
+#include "text_store.h"
+#include "piece_table.h"
+#include "utf8_codec.h"
+#include "worker_pool.h"
+#include <thread>
 
 class FileDialog {
   plx::ComPtr<IShellItem> item_;
@@ -58,46 +63,333 @@ public:
   }
 };
 
+// The document always uses LF, this is what the file on disk used.
+enum class LineEnding {
+  lf,
+  crlf
+};
+
 class PlainTextFileIO {
   const plx::FilePath path_;
   const size_t io_size = 32 * 1024;
+  // files this big are mapped instead of read.
+  const long long map_size = 64 * 1024 * 1024;
+  static const size_t max_carry = 3;
 
 public:
-  PlainTextFileIO(plx::FilePath& path) : path_(path) {
+  PlainTextFileIO(const plx::FilePath& path) : path_(path) {
+  }
+
+  // the text goes to a new file next to the old one, which then takes its place,
+  // so a failure at any point leaves the old file as it was.
+  //
+  // |unchanged| is how many characters at the start of |text| are, encoded the same
+  // way, already in the file. If that is at least half of the text the file is cut
+  // where they end and only the rest is written, in place. That is much less to
+  // write for a small edit near the end of a big file, but a crash or a full disk
+  // in the middle leaves the file cut, so callers pass 0 unless the user chose the
+  // speed over the safety. With |line_ending| of crlf the LFs are expanded as part
+  // of the encoding.
+  //
+  // |unchanged| must be 0 if |text| decodes from a mapping of the file, see
+  // MappedText, writing in place would change the bytes it is still reading.
+  void save(const TextSource& text, LineEnding line_ending, size_t unchanged) {
+    if (unchanged && (unchanged >= text.size() / 2) &&
+        save_tail(text, line_ending, unchanged))
+      return;
+
+    plx::FilePath temp(std::wstring(path_.raw()) + L".saving");
+    bool ok = false;
+    {
+      auto file = plx::File::Create(
+          temp, 
+          plx::FileParams::ReadWrite_SharedRead(CREATE_ALWAYS),
+          plx::FileSecurity());
+      if (!file.is_valid())
+        throw plx::IOException(__LINE__, temp.raw());
+      try {
+        ok = write_encoded(file, text, 0, line_ending) && file.flush();
+      } catch (...) {
+        ok = false;
+      }
+    }
+    if (!ok || !replace_with(temp)) {
+      ::DeleteFileW(temp.raw());
+      throw plx::IOException(__LINE__, path_.raw());
+    }
   }
 
-  void save(const std::wstring text) {
+  // reads and decodes |io_size| bytes at a time, appending to |store| as it goes,
+  // so besides the document it only needs memory for a block. All CRs are removed
+  // and the return says if most lines ended in CRLF.
+  LineEnding load(TextStore* store) {
     auto file = plx::File::Create(
         path_, 
-        plx::FileParams::ReadWrite_SharedRead(CREATE_ALWAYS),
+        plx::FileParams::ReadWrite_SharedRead(OPEN_EXISTING),
         plx::FileSecurity());
-    file_to_disk(file, text);
+    // the bytes of a multi-byte sequence cut by the end of a block are moved
+    // right in front of the next block.
+    std::unique_ptr<uint8_t[]> heap(new uint8_t[max_carry + io_size]);
+    auto block = heap.get() + max_carry;
+    std::unique_ptr<wchar_t[]> utf16(new wchar_t[max_carry + io_size]);
+    plx::CRStats cr_stats;
+    size_t carry = 0;
+    for (;;) {
+      auto bytes_read = file.read(block, io_size, -1);
+      if (!bytes_read)
+        break;
+      auto last = block + bytes_read;
+      auto start = block - carry;
+      auto end = last - incomplete_tail(start, last);
+      block_to_store(store, start, end, utf16.get(), &cr_stats);
+      carry = last - end;
+      ::memmove(block - carry, end, carry);
+    }
+    // a sequence cut by the end of the file gets replaced by U+FFFD.
+    block_to_store(store, block - carry, block, utf16.get(), &cr_stats);
+    return line_ending_of(cr_stats, store->line_count() - 1);
   }
 
-  std::unique_ptr<std::wstring> load() {
+  long long size_in_bytes() const {
     auto file = plx::File::Create(
         path_, 
-        plx::FileParams::ReadWrite_SharedRead(OPEN_EXISTING),
+        plx::FileParams::Read_SharedRead(),
         plx::FileSecurity());
-    // need to read the whole file at once because the UTF16 conversion fails if
-    // we end up trying to convert in the middle of multi-byte sequence.
-    return std::make_unique<std::wstring>(file_from_disk(file), false);
+    return file.size_in_bytes();
+  }
+
+  bool is_large() const {
+    return size_in_bytes() >= map_size;
+  }
+
+  // the alternative to load() for large files. The document is a piece table over
+  // the mapped file so only the parts that are used get decoded. The file stays
+  // open for as long as |store| or its snapshots are alive.
+  LineEnding map(std::unique_ptr<TextStore>* store) {
+    auto mapped = std::make_unique<MappedText>(path_);
+    auto raw = mapped.get();
+    *store = std::make_unique<PieceTable>(std::move(mapped));
+    return line_ending_of(raw->cr_stats(), (*store)->line_count() - 1);
   }
 
 private:
-  void file_to_disk(plx::File& file, const std::wstring& contents) {
-    auto block = plx::RangeFromString(contents);
-    auto utf8 = plx::UTF8FromUTF16(block);
-    file.write(plx::RangeFromString(utf8));
-  }
-
-  std::wstring file_from_disk(plx::File& file) {
-    auto fsz = file.size_in_bytes();
-    plx::Range<uint8_t> block(nullptr, fsz);
-    auto heap = plx::HeapRange(block);
-    auto bytes_read = file.read(block);
-    // remove all CR so we only end up with LF.
-    auto last = std::remove(block.start(), block.end(), '\r');
-    return plx::UTF16FromUTF8(plx::Range<const uint8_t>(block.start(), last), false);
+  typedef std::function<void(const wchar_t*, size_t)> BlockFn;
+
+  // returns false if the file is not there or is not the one |unchanged| refers
+  // to, in which case nothing was touched.
+  bool save_tail(const TextSource& text, LineEnding line_ending, size_t unchanged) {
+    auto file = plx::File::Create(
+        path_, 
+        plx::FileParams::ReadWrite_SharedRead(OPEN_EXISTING),
+        plx::FileSecurity());
+    if (!file.is_valid())
+      return false;
+    // a surrogate pair is kept or written whole. A high surrogate at the cut is
+    // encoded alone, not as the pair it was on disk, even if it ends the text.
+    if (IS_HIGH_SURROGATE(text.substr(unchanged - 1, 1)[0]))
+      --unchanged;
+    if (!unchanged)
+      return false;
+    uint64_t keep = 0;
+    for_each_block(text, 0, unchanged, [&](const wchar_t* block, size_t count) {
+      plx::Range<const uint16_t> utf16(reinterpret_cast<const uint16_t*>(block), count);
+      keep += plx::UTF8Length(utf16, line_ending == LineEnding::crlf);
+    });
+    if (keep > static_cast<uint64_t>(file.size_in_bytes()))
+      return false;
+    if (!file.set_size(keep) || !write_encoded(file, text, unchanged, line_ending))
+      throw plx::IOException(__LINE__, path_.raw());
+    return true;
+  }
+
+  // encodes [from, end) of |text| straight from where it is stored and appends it
+  // to |file|. The blocks are encoded a batch at a time, the blocks of a batch in
+  // parallel each to its own buffer of 3 x |io_size| bytes, and a batch is written
+  // in a single gathered write. The memory needed is the same for any size of text.
+  // Returns false if a write fails.
+  bool write_encoded(plx::File& file, const TextSource& text, size_t from,
+                     LineEnding line_ending) {
+    struct Block {
+      const wchar_t* text;
+      size_t count;
+      // the pair for_each_block() joins only lives during the call.
+      wchar_t pair[2];
+      std::unique_ptr<uint8_t[]> utf8;
+      size_t used;
+    };
+
+    WorkerPool pool((text.size() - from > io_size) ? WorkerPool::default_size() : 0);
+    std::vector<Block> batch(std::max<size_t>(1, 2 * pool.size()));
+    for (auto& block : batch)
+      block.utf8.reset(new uint8_t[3 * io_size]);
+    auto expand_lf = (line_ending == LineEnding::crlf);
+    size_t filled = 0;
+    bool ok = true;
+
+    auto write_batch = [&]() {
+      for (size_t ix = 0; ix != filled; ++ix) {
+        auto block = &batch[ix];
+        pool.post([block, expand_lf]() {
+          plx::Range<const uint16_t> utf16(
+              reinterpret_cast<const uint16_t*>(block->text), block->count);
+          block->used = expand_lf ?
+              plx::EncodeUTF8ExpandLF(utf16, block->utf8.get(), false) :
+              plx::EncodeUTF8(utf16, block->utf8.get(), false);
+        });
+      }
+      pool.wait();
+      std::vector<plx::Range<const uint8_t>> ranges;
+      size_t total = 0;
+      for (size_t ix = 0; ix != filled; ++ix) {
+        const uint8_t* utf8 = batch[ix].utf8.get();
+        ranges.emplace_back(utf8, batch[ix].used);
+        total += batch[ix].used;
+      }
+      if (ok && (file.write(ranges, -1) != total))
+        ok = false;
+      filled = 0;
+    };
+
+    for_each_block(text, from, text.size(), [&](const wchar_t* chunk, size_t count) {
+      auto& block = batch[filled++];
+      if (count <= 2) {
+        std::copy(chunk, chunk + count, block.pair);
+        chunk = block.pair;
+      }
+      block.text = chunk;
+      block.count = count;
+      if (filled == batch.size())
+        write_batch();
+    });
+    write_batch();
+    return ok;
+  }
+
+  // puts |temp| in place of the file. ReplaceFile() keeps the attributes of the
+  // old file but needs it to exist. A file that is mapped can be renamed but not
+  // deleted, so the old file is first renamed to a backup which is deleted if it
+  // can be. If the document still maps it, it goes with the next save.
+  bool replace_with(const plx::FilePath& temp) {
+    plx::FilePath backup(std::wstring(path_.raw()) + L".replaced");
+    ::DeleteFileW(backup.raw());
+    if (::ReplaceFileW(path_.raw(), temp.raw(), backup.raw(),
+                       REPLACEFILE_IGNORE_MERGE_ERRORS, nullptr, nullptr)) {
+      ::DeleteFileW(backup.raw());
+      return true;
+    }
+    return ::MoveFileExW(temp.raw(), path_.raw(),
+                         MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? true : false;
+  }
+
+  // calls |fn| with the text of [from, to) as it is stored, in blocks of at most
+  // |io_size| characters. A surrogate pair split between two chunks is put back
+  // together here, otherwise the encoder replaces each half with U+FFFD.
+  void for_each_block(const TextSource& text, size_t from, size_t to, const BlockFn& fn) const {
+    wchar_t pair[2] = {0};
+    text.for_each_chunk(from, to, [&](size_t, const wchar_t* chunk, size_t len) {
+      if (pair[0] && len) {
+        if (IS_LOW_SURROGATE(*chunk)) {
+          pair[1] = *chunk++;
+          --len;
+          fn(pair, 2);
+        } else {
+          fn(pair, 1);
+        }
+        pair[0] = 0;
+      }
+      if (len && IS_HIGH_SURROGATE(chunk[len - 1]))
+        pair[0] = chunk[--len];
+      while (len) {
+        auto count = std::min(len, io_size);
+        if ((count != len) && IS_HIGH_SURROGATE(chunk[count - 1]))
+          --count;
+        fn(chunk, count);
+        chunk += count;
+        len -= count;
+      }
+      return true;
+    });
+    if (pair[0])
+      fn(pair, 1);
+  }
+
+  static LineEnding line_ending_of(const plx::CRStats& cr_stats, size_t newlines) {
+    // LFs that did not come after a CR.
+    auto lf = newlines - cr_stats.crlf;
+    return (cr_stats.crlf > lf) ? LineEnding::crlf : LineEnding::lf;
+  }
+
+  // returns how many bytes at the end of [start, end) are the beginning of a
+  // multi-byte sequence that continues in the next block.
+  static size_t incomplete_tail(const uint8_t* start, const uint8_t* end) {
+    auto it = end;
+    while ((it != start) && (static_cast<size_t>(end - it) <= max_carry)) {
+      auto c = *(--it);
+      if ((c & 0xC0) == 0x80)
+        continue;
+      size_t need = (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : (c >= 0xC0) ? 2 : 1;
+      return (static_cast<size_t>(end - it) < need) ? end - it : 0;
+    }
+    return 0;
+  }
+
+  // |utf16| has room for a character per byte. The CRs are dropped in the same
+  // pass that decodes.
+  static void block_to_store(TextStore* store,
+                             const uint8_t* start, const uint8_t* end,
+                             wchar_t* utf16, plx::CRStats* cr_stats) {
+    auto count = plx::DecodeUTF8StripCR(plx::Range<const uint8_t>(start, end),
+                                        reinterpret_cast<uint16_t*>(utf16), false, cr_stats);
+    store->insert(store->size(), utf16, count);
+  }
+};
+
+// Saves a version of the document on a worker thread so the UI does not freeze
+// for big files. The version shares storage with the document so it is cheap to
+// make and it does not change if the user keeps typing. When the save is done
+// |message| is posted to |window| with a wparam of TRUE if it succeeded; then
+// the owner must call finish(). Before that, |saved| is called on the thread if
+// the save succeeded, for work on the new file that should not freeze the UI.
+class BackgroundSave {
+  std::thread thread_;
+
+  BackgroundSave& operator=(const BackgroundSave&) = delete;
+  BackgroundSave(const BackgroundSave&) = delete;
+
+public:
+  BackgroundSave() {}
+
+  ~BackgroundSave() {
+    finish();
+  }
+
+  bool busy() const {
+    return thread_.joinable();
+  }
+
+  void start(HWND window, UINT message,
+             const plx::FilePath& path, std::shared_ptr<const TextSource> text,
+             LineEnding line_ending, size_t unchanged, std::function<void()> saved) {
+    if (busy())
+      __debugbreak();
+    thread_ = std::thread([window, message, path, text, line_ending, unchanged, saved]() {
+      BOOL ok = TRUE;
+      try {
+        PlainTextFileIO ptfio(path);
+        ptfio.save(*text, line_ending, unchanged);
+        if (saved)
+          saved();
+      } catch (...) {
+        // not just plx exceptions, running out of memory encoding a big document
+        // is a failed save too and not a crash.
+        ok = FALSE;
+      }
+      ::PostMessageW(window, message, ok, 0);
+    });
+  }
+
+  void finish() {
+    if (thread_.joinable())
+      thread_.join();
   }
 };
@@ -22,6 +22,8 @@ class FindControl : public MessageTarget {
   plx::ComPtr<ID2D1Geometry> geometry_;
 
   std::wstring search_text_;
+  // ctrl+r goes to the next one.
+  TextFinder::Mode mode_;
   TextView* text_view_;
 
   enum BrushesHover {
@@ -47,6 +49,7 @@ public:
         has_focus_(true),
         root_visual_(root_visual),
         dwrite_factory_(dwrite_factory),
+        mode_(TextFinder::literal),
         text_view_(nullptr),
         brushes_(brush_last) {
 
@@ -83,8 +86,10 @@ public:
     root_visual_->RemoveVisual(visual_.Get());
   }
 
+  // the view searches in the mode this control shows.
   void set_textview(TextView* tv) {
     text_view_ = tv;
+    text_view_->set_find_mode(mode_);
   }
   
   void set_position(float x, float y) {
@@ -121,11 +126,18 @@ public:
         // backspace.
         if (!search_text_.empty())
           search_text_.resize(search_text_.size() - 1);
+      } else if (c == 0x12) {
+        // ctrl+r: literal, then any case and accent, regex and fuzzy.
+        mode_ = (mode_ == TextFinder::literal) ? TextFinder::folded :
+                (mode_ == TextFinder::folded) ? TextFinder::regex :
+                (mode_ == TextFinder::regex) ? TextFinder::fuzzy : TextFinder::literal;
+        if (text_view_)
+          text_view_->set_find_mode(mode_);
       } else {
         return 0L;
       }
  
-      update_layout(search_text_);
+      update_layout(mode_prefix() + search_text_);
       draw();
       // inform the textview.
       if (search_text_.size() > 1) {
@@ -153,6 +165,16 @@ public:
   }
 
 private:
+  std::wstring mode_prefix() const {
+    if (mode_ == TextFinder::folded)
+      return L"aA: ";
+    if (mode_ == TextFinder::regex)
+      return L"re: ";
+    if (mode_ == TextFinder::fuzzy)
+      return L"~: ";
+    return std::wstring();
+  }
+
   void update_layout(const std::wstring& text) {
     plx::Range<const wchar_t> r(&text[0], text.size());
     dwrite_layout_ = plx::CreateDWTextLayout(
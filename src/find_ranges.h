@@ -0,0 +1,277 @@
+// TExTO.  Copyright 2014, Carlos Pizano (carlos.pizano@gmail.com)
+// TExTO is a text editor prototype. This is the set of matches that find keeps
+// and draws.
+
+#pragma once
+#include "stdafx.h"
+
+// The matches of a query sorted by where they start. Literal matches all have the
+// query length so they can overlap, like "aa" three times in "aaaa", and are still
+// sorted by where they end. Regex matches each have their own length but they never
+// overlap, so they are sorted by where they end too. That is what lets get() find the
+// ones in view with two binary searches.
+//
+// A short query can have millions of matches, so they are stored compactly. The starts
+// go in blocks of up to |block_size|, each block keeps its first start and each match
+// its 32-bit distance from it: a bit over 4 bytes per match, 8 when each has its
+// own length. get() returns a Span that
+// decodes the matches as it is walked, nothing gets copied.
+//
+// Edits keep the matches, see replace(). Only the blocks with matches that touch the
+// edit are rebuilt, the blocks after it just move their first start.
+class Ranges {
+public:
+  using Tup = std::tuple<size_t, size_t>;
+  static const size_t block_size = 64;
+
+private:
+  struct Block {
+    size_t base;
+    // the distance of each start from |base|, the first one is 0.
+    std::vector<uint32_t> offsets;
+    // the length of each match if |length_| is 0, else empty.
+    std::vector<uint32_t> lengths;
+  };
+
+  // never has an empty block.
+  std::vector<Block> blocks_;
+  size_t size_;
+  // the length of all the matches, 0 if each has its own.
+  size_t length_;
+
+public:
+  class Iterator {
+    const Ranges* ranges_;
+    // past the end is |block_| == blocks_.size() and |ix_| == 0.
+    size_t block_;
+    size_t ix_;
+
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Tup;
+    using difference_type = ptrdiff_t;
+    using pointer = const Tup*;
+    using reference = Tup;
+
+    Iterator(const Ranges* ranges, size_t block, size_t ix)
+        : ranges_(ranges), block_(block), ix_(ix) {
+      if ((block_ != ranges_->blocks_.size()) && (ix_ == ranges_->blocks_[block_].offsets.size())) {
+        ++block_;
+        ix_ = 0;
+      }
+    }
+
+    size_t start() const {
+      auto& block = ranges_->blocks_[block_];
+      return block.base + block.offsets[ix_];
+    }
+
+    size_t end() const {
+      auto& block = ranges_->blocks_[block_];
+      auto length = ranges_->length_ ? ranges_->length_ : block.lengths[ix_];
+      return block.base + block.offsets[ix_] + length;
+    }
+
+    Tup operator*() const {
+      return Tup(start(), end());
+    }
+
+    Iterator& operator++() {
+      if (++ix_ == ranges_->blocks_[block_].offsets.size()) {
+        ++block_;
+        ix_ = 0;
+      }
+      return *this;
+    }
+
+    bool operator==(const Iterator& other) const {
+      return (block_ == other.block_) && (ix_ == other.ix_);
+    }
+
+    bool operator!=(const Iterator& other) const { return !(*this == other); }
+
+    friend class Ranges;
+  };
+
+  class Span {
+    Iterator begin_;
+    Iterator end_;
+
+  public:
+    Span(Iterator begin, Iterator end) : begin_(begin), end_(end) {}
+    Iterator begin() const { return begin_; }
+    Iterator end() const { return end_; }
+    bool empty() const { return begin_ == end_; }
+  };
+
+  Ranges() : size_(0), length_(0) {}
+
+  bool empty() const { return size_ == 0; }
+  size_t size() const { return size_; }
+  size_t length() const { return length_; }
+
+  Iterator begin() const { return Iterator(this, 0, 0); }
+  Iterator end() const { return Iterator(this, blocks_.size(), 0); }
+
+  // removes all and from now on the matches are |length| long, or of any length
+  // if it is 0.
+  void reset(size_t length) {
+    blocks_.clear();
+    size_ = 0;
+    length_ = length;
+  }
+
+  void clear() { reset(0); }
+
+  void swap(Ranges& other) {
+    blocks_.swap(other.blocks_);
+    std::swap(size_, other.size_);
+    std::swap(length_, other.length_);
+  }
+
+  // |start| can't be before the last one added.
+  void add(size_t start, size_t end) {
+    append(&blocks_, start, end);
+    ++size_;
+  }
+
+  // adds the |found| matches, sorted, which can go anywhere.
+  void merge(const std::vector<Tup>& found) {
+    if (found.empty())
+      return;
+    if (empty() || (std::get<0>(found.front()) >= last_start())) {
+      for (auto& f : found)
+        add(std::get<0>(f), std::get<1>(f));
+      return;
+    }
+    Ranges merged;
+    merged.reset(length_);
+    merged.blocks_.reserve((size_ + found.size()) / block_size + 1);
+    auto ix = begin();
+    auto it = found.begin();
+    while ((ix != end()) || (it != found.end())) {
+      if ((it == found.end()) || ((ix != end()) && (ix.start() < std::get<0>(*it)))) {
+        merged.add(ix.start(), ix.end());
+        ++ix;
+      } else {
+        merged.add(std::get<0>(*it), std::get<1>(*it));
+        ++it;
+      }
+    }
+    swap(merged);
+  }
+
+  // keeps the matches for which |keep| of the start is true, and they become
+  // |length| long.
+  template <typename Fn>
+  void filter(const Fn& keep, size_t length) {
+    Ranges kept;
+    kept.reset(length);
+    for (auto ix = begin(); ix != end(); ++ix) {
+      if (keep(ix.start()))
+        kept.add(ix.start(), ix.start() + length);
+    }
+    swap(kept);
+  }
+
+  // the matches that touch [start, end].
+  Span get(size_t start, size_t end) const {
+    auto lb = first_ending(start);
+    if ((lb == this->end()) || (lb.start() >= end))
+      return Span(lb, lb);
+    return Span(lb, lower_bound(end));
+  }
+
+  // [pos, pos + erased) of the text became |inserted| characters. The matches that
+  // start in [from, to) of the old text, which has the edit, are gone and |found|
+  // has the ones that start there in the new text. The ones after move by
+  // |inserted| - |erased|.
+  void replace(size_t from, size_t to, size_t erased, size_t inserted,
+               const std::vector<Tup>& found) {
+    auto first = lower_bound(from);
+    auto last = lower_bound(to);
+    // the blocks from the one of |first| to the one of |last| are rebuilt.
+    auto block_end = std::min(last.block_ + 1, blocks_.size());
+    std::vector<Block> rebuilt;
+    size_t count = 0;
+    auto add_to = [this, &rebuilt, &count](size_t start, size_t end) {
+      append(&rebuilt, start, end);
+      ++count;
+    };
+    for (auto ix = Iterator(this, first.block_, 0); ix != first; ++ix)
+      add_to(ix.start(), ix.end());
+    for (auto& f : found)
+      add_to(std::get<0>(f), std::get<1>(f));
+    auto delta = inserted - erased;
+    for (auto ix = last; (ix != end()) && (ix.block_ < block_end); ++ix)
+      add_to(ix.start() + delta, ix.end() + delta);
+
+    size_t old_count = 0;
+    for (auto b = first.block_; b < block_end; ++b)
+      old_count += blocks_[b].offsets.size();
+    size_ = size_ - old_count + count;
+
+    auto at = blocks_.erase(blocks_.begin() + first.block_, blocks_.begin() + block_end);
+    auto index = static_cast<size_t>(at - blocks_.begin());
+    blocks_.insert(at, std::make_move_iterator(rebuilt.begin()), std::make_move_iterator(rebuilt.end()));
+    for (auto b = index + rebuilt.size(); b != blocks_.size(); ++b)
+      blocks_[b].base = blocks_[b].base - erased + inserted;
+  }
+
+private:
+  size_t last_start() const {
+    auto& block = blocks_.back();
+    return block.base + block.offsets.back();
+  }
+
+  // a new block starts when the last is full or the distance does not fit.
+  void append(std::vector<Block>* blocks, size_t start, size_t end) const {
+    if (blocks->empty() || (blocks->back().offsets.size() == block_size) ||
+        (start - blocks->back().base > 0xFFFFFFFFull)) {
+      Block block = { start };
+      block.offsets.reserve(block_size);
+      block.offsets.push_back(0);
+      blocks->push_back(std::move(block));
+    } else {
+      blocks->back().offsets.push_back(static_cast<uint32_t>(start - blocks->back().base));
+    }
+    if (!length_)
+      blocks->back().lengths.push_back(static_cast<uint32_t>(end - start));
+  }
+
+  // the first match that ends at or after |pos|.
+  Iterator first_ending(size_t pos) const {
+    auto bit = std::partition_point(blocks_.begin(), blocks_.end(),
+        [this, pos](const Block& block) { return last_end(block) < pos; });
+    if (bit == blocks_.end())
+      return end();
+    auto b = static_cast<size_t>(bit - blocks_.begin());
+    size_t ix = 0;
+    while (Iterator(this, b, ix).end() < pos)
+      ++ix;
+    return Iterator(this, b, ix);
+  }
+
+  size_t last_end(const Block& block) const {
+    auto length = length_ ? length_ : block.lengths.back();
+    return block.base + block.offsets.back() + length;
+  }
+
+  // the first match that starts at or after |pos|.
+  Iterator lower_bound(size_t pos) const {
+    auto bit = std::lower_bound(blocks_.begin(), blocks_.end(), pos,
+        [](const Block& block, size_t p) { return block.base < p; });
+    if (bit == blocks_.begin())
+      return begin();
+    // |pos| is in the block before.
+    --bit;
+    auto& offsets = bit->offsets;
+    auto distance = pos - bit->base;
+    auto it = std::lower_bound(offsets.begin(), offsets.end(), distance,
+        [](uint32_t offset, size_t d) { return offset < d; });
+    return Iterator(this, static_cast<size_t>(bit - blocks_.begin()),
+                    static_cast<size_t>(it - offsets.begin()));
+  }
+};
+
+const size_t Ranges::block_size;
@@ -0,0 +1,105 @@
+// TExTO.  Copyright 2014, Carlos Pizano (carlos.pizano@gmail.com)
+// TExTO is a text editor prototype. This is the case and accent folding that
+// the insensitive find searches through.
+
+#pragma once
+#include "stdafx.h"
+#include "text_store.h"
+
+// Looking for "zoe" should find "Zoë", so both the query and the text are folded:
+// lowercase and without accents. Folding each character in the search loop would
+// make it several times slower, instead each span of the text is folded into a
+// buffer as the search reaches it and the normal literal search runs on the buffer
+// at full speed. Every unit folds to exactly one unit, an offset in the folded text
+// is the same offset in the document and the matches need no mapping back. That
+// leaves out the folds that change the length, like "ß" to "ss", and the combining
+// accents, which stay as they are.
+//
+// There is no folded copy of the document to keep up to date. The folding happens
+// in the search tasks, in parallel and off the window's thread, edits cost nothing
+// and a large mapped file is not decoded in full before the search can start.
+class FoldedText {
+  // the fold of each unit, made once and then only read.
+  std::vector<wchar_t> fold_;
+
+  // |text| folded, a span at a time.
+  class Source : public TextSource {
+    std::shared_ptr<const TextSource> owner_;
+    const TextSource& text_;
+    const wchar_t* fold_;
+
+  public:
+    Source(std::shared_ptr<const TextSource> owner, const TextSource& text,
+           const wchar_t* fold)
+        : owner_(owner), text_(text), fold_(fold) {
+    }
+
+    size_t size() const override { return text_.size(); }
+
+    void for_each_chunk(size_t from, size_t to, const ChunkFn& fn) const override {
+      // the tasks search at the same time, each has its own buffer.
+      std::wstring folded;
+      text_.for_each_chunk(from, to, [this, &fn, &folded](size_t offset, const wchar_t* chunk,
+                                                          size_t len) {
+        folded.resize(len);
+        for (size_t ix = 0; ix != len; ++ix)
+          folded[ix] = fold_[static_cast<uint16_t>(chunk[ix])];
+        return fn(offset, folded.c_str(), len);
+      });
+    }
+  };
+
+  FoldedText& operator=(const FoldedText&) = delete;
+  FoldedText(const FoldedText&) = delete;
+
+public:
+  FoldedText() {
+  }
+
+  std::wstring fold(const std::wstring& text) {
+    make_table();
+    std::wstring folded(text);
+    for (auto& c : folded)
+      c = fold_[static_cast<uint16_t>(c)];
+    return folded;
+  }
+
+  // |text| as the search sees it, folded. It can be read from other threads.
+  std::shared_ptr<const TextSource> view(std::shared_ptr<const TextSource> text) {
+    make_table();
+    auto& source = *text;
+    return std::make_shared<Source>(text, source, &fold_[0]);
+  }
+
+  // the same, for |text| that outlives the view.
+  std::unique_ptr<const TextSource> view(const TextSource& text) {
+    make_table();
+    return std::make_unique<Source>(nullptr, text, &fold_[0]);
+  }
+
+private:
+  // lowercase as Windows does it and then the latin letters with accents become
+  // the plain letter.
+  void make_table() {
+    if (!fold_.empty())
+      return;
+    fold_.resize(0x10000);
+    for (size_t u = 0; u != 0x10000; ++u)
+      fold_[u] = static_cast<wchar_t>(u);
+    // surrogates are left alone.
+    ::CharLowerBuffW(&fold_[1], 0xD800 - 1);
+    ::CharLowerBuffW(&fold_[0xE000], 0x10000 - 0xE000);
+
+    // from U+00C0 to U+017F, a dot is a letter that stays.
+    const char latin[] =
+        "aaaaaa.ceeeeiiii.nooooo.ouuuuy.."
+        "aaaaaa.ceeeeiiii.nooooo.ouuuuy.y"
+        "aaaaaaccccccccddddeeeeeeeeeegggggggghhhhiiiiiiiiii..jjkk."
+        "llllllllllnnnnnn...oooooo..rrrrrrssssssssttttttuuuuuuuuuuuuwwyyyzzzzzzs";
+    for (auto& c : fold_) {
+      auto u = static_cast<uint16_t>(c);
+      if ((u >= 0xC0) && (u <= 0x17F) && (latin[u - 0xC0] != '.'))
+        c = latin[u - 0xC0];
+    }
+  }
+};
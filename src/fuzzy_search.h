@@ -0,0 +1,176 @@
+// TExTO.  Copyright 2014, Carlos Pizano (carlos.pizano@gmail.com)
+// TExTO is a text editor prototype. This is the approximate search used by find.
+
+#pragma once
+#include "stdafx.h"
+#include "text_search.h"
+
+// A match is a piece of text that is at most |max_distance| edits (a unit inserted,
+// deleted or changed) away from the needle, so "Jonh" or "Jhon" find "John".
+//
+// Where matches end comes from Myers' bit-vector algorithm: the column of the edit
+// distance table for the whole needle fits in a 64-bit word, kept as the +1 and -1
+// differences between its cells, and each unit of text updates it with a dozen
+// word operations no matter the distance allowed. That is what limits the needle to
+// |max_needle| units; longer ones are searched exactly. When the distance first gets
+// within the limit the next |max_distance| ends are looked at too and the one with
+// the fewest edits wins, then a small table for just that end finds where the match
+// starts. Matches don't overlap and, like regex matches, don't span lines.
+
+namespace plx {
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::FuzzySearch
+// needle_ : the UTF-16 units to find.
+// slot_ : for each unit, its entry in |peq_| or 0 if the needle does not have it.
+// peq_ : for each distinct unit of the needle, the bits of where it is in the needle.
+// max_distance_ : the edits a match can have, less than the needle length.
+// exact_ : the search for needles too long for a word.
+//
+class FuzzySearch {
+  std::vector<uint16_t> needle_;
+  std::vector<uint8_t> slot_;
+  std::vector<uint64_t> peq_;
+  size_t max_distance_;
+  std::unique_ptr<SubstringSearch> exact_;
+
+  FuzzySearch& operator=(const FuzzySearch&) = delete;
+  FuzzySearch(const FuzzySearch&) = delete;
+
+public:
+  static const size_t npos = static_cast<size_t>(-1);
+  static const size_t max_needle = 64;
+
+  FuzzySearch(const plx::Range<const uint16_t>& needle, size_t max_distance)
+      : needle_(needle.start(), needle.end()),
+        max_distance_(needle_.empty() ? 0 : std::min(max_distance, needle_.size() - 1)) {
+    auto m = needle_.size();
+    if (m > max_needle) {
+      exact_ = std::make_unique<SubstringSearch>(needle);
+      max_distance_ = 0;
+      return;
+    }
+    slot_.resize(0x10000);
+    peq_.push_back(0);
+    for (size_t ix = 0; ix != m; ++ix) {
+      auto& slot = slot_[needle_[ix]];
+      if (!slot) {
+        slot = static_cast<uint8_t>(peq_.size());
+        peq_.push_back(0);
+      }
+      peq_[slot] |= 1ull << ix;
+    }
+  }
+
+  size_t size() const { return needle_.size(); }
+  size_t max_distance() const { return max_distance_; }
+
+  // calls |fn| with the (start, end) of the matches in |line|.
+  template <typename Fn>
+  void for_each_match(const plx::Range<const uint16_t>& line, const Fn& fn) const {
+    auto m = needle_.size();
+    auto n = line.size();
+    auto s = line.start();
+    if (!m)
+      return;
+    if (exact_) {
+      for (auto x = exact_->find(line, 0); x != npos; x = exact_->find(line, x + m))
+        fn(x, x + m);
+      return;
+    }
+
+    const uint64_t high = 1ull << (m - 1);
+    // the vertical +1 and -1 differences of the column, and its last cell: the
+    // edits of the best match that ends at the current unit.
+    uint64_t pv = ~0ull;
+    uint64_t mv = 0;
+    size_t score = m;
+    // the end of the last match, the next one can't start before.
+    size_t last_end = 0;
+    // the best end since the distance got within the limit, and until when a better
+    // one is looked for.
+    size_t best = npos;
+    size_t best_score = 0;
+    size_t deadline = 0;
+
+    for (size_t ix = 0; ix != n; ++ix) {
+      auto eq = peq_[slot_[s[ix]]];
+      auto xv = eq | mv;
+      auto xh = (((eq & pv) + pv) ^ pv) | eq;
+      auto ph = mv | ~(xh | pv);
+      auto mh = pv & xh;
+      if (ph & high)
+        ++score;
+      else if (mh & high)
+        --score;
+      // a match can start anywhere, so no +1 goes in at the top.
+      ph <<= 1;
+      mh <<= 1;
+      pv = mh | ~(xv | ph);
+      mv = ph & xv;
+
+      if (best == npos) {
+        if (score > max_distance_)
+          continue;
+        best = ix;
+        best_score = score;
+        deadline = ix + max_distance_;
+      } else if (score < best_score) {
+        best = ix;
+        best_score = score;
+      }
+      if (ix == deadline) {
+        report(s, &last_end, best + 1, fn);
+        best = npos;
+      }
+    }
+    if (best != npos)
+      report(s, &last_end, best + 1, fn);
+  }
+
+private:
+  template <typename Fn>
+  void report(const uint16_t* s, size_t* last_end, size_t end, const Fn& fn) const {
+    auto longest = needle_.size() + max_distance_;
+    auto lo = std::max(*last_end, (end > longest) ? end - longest : 0);
+    size_t start;
+    if (best_start(s, lo, end, &start) > max_distance_)
+      return;
+    fn(start, end);
+    *last_end = end;
+  }
+
+  // finds the start in [lo, end) with the fewest edits between the needle and
+  // [start, end), the closest to |end| if several have them. Returns the edits.
+  size_t best_start(const uint16_t* s, size_t lo, size_t end, size_t* start) const {
+    auto m = needle_.size();
+    // col[i] is the edits between the last i units of the needle and the text read
+    // so far backwards from |end|, which must all be used.
+    size_t col[max_needle + 1];
+    for (size_t i = 0; i <= m; ++i)
+      col[i] = i;
+    auto best = col[m];
+    *start = end;
+    for (size_t c = 1; c <= end - lo; ++c) {
+      auto unit = s[end - c];
+      auto diag = col[0];
+      col[0] = c;
+      for (size_t i = 1; i <= m; ++i) {
+        auto left = col[i];
+        auto change = diag + ((needle_[m - i] == unit) ? 0 : 1);
+        col[i] = std::min(change, std::min(left, col[i - 1]) + 1);
+        diag = left;
+      }
+      if (col[m] < best) {
+        best = col[m];
+        *start = end - c;
+      }
+    }
+    return best;
+  }
+};
+
+const size_t FuzzySearch::npos;
+const size_t FuzzySearch::max_needle;
+
+}  // namespace plx
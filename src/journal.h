@@ -0,0 +1,313 @@
+// TExTO.  Copyright 2014, Carlos Pizano (carlos.pizano@gmail.com)
+// TExTO is a text editor prototype. This is the journal of edits that brings
+// back the work lost by a crash.
+
+#pragma once
+#include "stdafx.h"
+#include "text_store.h"
+#include <atomic>
+#include <thread>
+
+// Every edit made since the file was loaded or saved goes to a journal file next to
+// it, named like the file plus ".journal". When the file is loaded again the journal
+// is replayed on top of it, which restores the session as it was when it ended, be it
+// a crash or not.
+//
+// Edits are encoded into |pending_| as they happen. flush(), which the window calls
+// from a timer, hands them to a thread that appends them to the file so typing never
+// waits for the disk. The file is opened write-through, what is written survives.
+// A record cut short by a crash is cut off the file on replay, before new records
+// are appended after it. If it can't be cut the whole records are still replayed but
+// the journal is left as it is and the session is not journaled.
+//
+// The file starts with a Header that has the Base, the file the journal applies to,
+// followed by Records. An insert record is followed by the inserted text. A file
+// edited elsewhere can keep its size, so the Base also has when it was last written
+// and a hash of its bytes, and a journal for any other file is not replayed. The
+// hash means reading the whole file, so a load only takes it when there is a journal
+// whose size and time match, and a new journal gets it on the journal thread.
+class EditJournal {
+  static const uint32_t magic = 0x324A5854;   // 'TXJ2'.
+  static const uint32_t insert_kind = 'i';
+  static const uint32_t erase_kind = 'e';
+
+public:
+  struct Base {
+    uint64_t size;
+    uint64_t write_time;
+    // 0 until it is computed.
+    uint64_t hash;
+  };
+
+private:
+  struct Header {
+    uint32_t magic;
+    uint32_t unused;
+    Base base;
+  };
+
+  struct Record {
+    uint32_t kind;
+    uint32_t unused;
+    uint64_t pos;
+    uint64_t count;
+  };
+
+  std::unique_ptr<plx::FilePath> path_;
+  std::unique_ptr<plx::File> file_;
+  // records not written yet and the ones the thread is writing.
+  std::vector<uint8_t> pending_;
+  std::vector<uint8_t> writing_;
+  std::atomic<bool> busy_;
+  std::atomic<bool> failed_;
+  std::thread thread_;
+  // while a save runs the records also go to |marked_|, see mark().
+  bool marking_;
+  std::vector<uint8_t> marked_;
+
+  EditJournal& operator=(const EditJournal&) = delete;
+  EditJournal(const EditJournal&) = delete;
+
+public:
+  // there is no file until open(), records are dropped unless marking.
+  EditJournal() : busy_(false), failed_(false), marking_(false) {}
+
+  ~EditJournal() {
+    close();
+  }
+
+  static plx::FilePath path_for(const plx::FilePath& file) {
+    return plx::FilePath(std::wstring(file.raw()) + L".journal");
+  }
+
+  // the Base of |file| without the hash, which is cheap.
+  static Base stamp_of(const plx::FilePath& file) {
+    Base base = {0};
+    auto f = plx::File::Create(file, plx::FileParams::Read_SharedRead(), plx::FileSecurity());
+    if (!f.is_valid())
+      return base;
+    base.size = f.size_in_bytes();
+    base.write_time = f.last_write_time();
+    return base;
+  }
+
+  // reads all of |file| for the hash, so for a big file call it where a wait is
+  // not a problem.
+  static Base base_of(const plx::FilePath& file) {
+    Base base = {0};
+    auto f = plx::File::Create(file, plx::FileParams::Read_SharedRead(), plx::FileSecurity());
+    if (!f.is_valid())
+      return base;
+    base.size = f.size_in_bytes();
+    base.write_time = f.last_write_time();
+    base.hash = hash_of(f);
+    return base;
+  }
+
+  // applies the journal at |path| to |doc|, which must be what got loaded from
+  // |file| of |base|. If the journal can be for it and |base| has no hash yet, it
+  // is computed here, a wait that only happens when there is work to recover.
+  // Returns false if there is no journal for that file. Otherwise |appendable|
+  // says if open() can add to it.
+  static bool replay(const plx::FilePath& path, const plx::FilePath& file, Base* base,
+                     TextStore* doc, bool* appendable) {
+    auto file = plx::File::Create(
+        path, plx::FileParams::ReadWrite_SharedRead(OPEN_EXISTING), plx::FileSecurity());
+    if (!file.is_valid())
+      return false;
+    auto size = plx::To<size_t>(file.size_in_bytes());
+    if (size < sizeof(Header))
+      return false;
+    std::vector<uint8_t> bytes(size);
+    if (file.read(&bytes[0], size, 0) != size)
+      return false;
+    Header header;
+    memcpy(&header, &bytes[0], sizeof(header));
+    if ((header.magic != magic) ||
+        (header.base.size != base->size) ||
+        (header.base.write_time != base->write_time))
+      return false;
+    if (!base->hash)
+      base->hash = base_of(file).hash;
+    if (header.base.hash != base->hash)
+      return false;
+
+    // what follows the last good record is cut off, otherwise the records open()
+    // appends would be read as part of it next time.
+    auto records = &bytes[0] + sizeof(header);
+    auto count = size - sizeof(header);
+    auto used = play(records, count, doc);
+    *appendable = (used == count) || file.set_size(sizeof(header) + used);
+    return true;
+  }
+
+  // from now on the edits go to the journal at |path| for |file| of |base|. It is
+  // created if it does not exist, otherwise it must be one replay() accepted. If it
+  // can't be opened, say in a read-only folder, the edits are not journaled. A new
+  // journal for a |base| without hash gets its header once the journal thread has
+  // hashed |file|, the records wait for it.
+  void open(const plx::FilePath& path, const plx::FilePath& file, const Base& base) {
+    close();
+    auto params = plx::FileParams(FILE_APPEND_DATA, FILE_SHARE_READ, OPEN_ALWAYS,
+                                  FILE_ATTRIBUTE_NORMAL, FILE_FLAG_WRITE_THROUGH, 0);
+    auto file = plx::File::Create(path, params, plx::FileSecurity());
+    if (!file.is_valid())
+      return;
+    file_ = std::make_unique<plx::File>(std::move(file));
+    path_ = std::make_unique<plx::FilePath>(path);
+    failed_ = false;
+    if (file_->size_in_bytes())
+      return;
+    if (base.hash) {
+      Header header = { magic, 0, base };
+      append(&header, sizeof(header));
+      return;
+    }
+    busy_ = true;
+    thread_ = std::thread([this, file, base]() {
+      Header header = { magic, 0, base };
+      header.base.hash = base_of(file).hash;
+      if (file_->write(reinterpret_cast<const uint8_t*>(&header), sizeof(header), -1) != sizeof(header))
+        failed_ = true;
+      busy_ = false;
+    });
+  }
+
+  // writes what is left and stops journaling.
+  void close() {
+    finish();
+    if (file_ && !pending_.empty() && !failed_)
+      file_->write(&pending_[0], pending_.size(), -1);
+    file_.reset();
+    path_.reset();
+    pending_.clear();
+    marking_ = false;
+    marked_.clear();
+  }
+
+  void insert(size_t pos, const wchar_t* text, size_t count) {
+    Record record = { insert_kind, 0, pos, count };
+    append(&record, sizeof(record));
+    append(text, count * sizeof(wchar_t));
+  }
+
+  void erase(size_t pos, size_t count) {
+    Record record = { erase_kind, 0, pos, count };
+    append(&record, sizeof(record));
+  }
+
+  // starts writing the pending records unless the previous write is still going.
+  void flush() {
+    if (busy_)
+      return;
+    finish();
+    if (!file_ || pending_.empty() || failed_)
+      return;
+    writing_.swap(pending_);
+    pending_.clear();
+    busy_ = true;
+    thread_ = std::thread([this]() {
+      if (file_->write(&writing_[0], writing_.size(), -1) != writing_.size())
+        failed_ = true;
+      busy_ = false;
+    });
+  }
+
+  // a save of the current document started, the records that follow are the
+  // ones a journal for the saved file needs.
+  void mark() {
+    marking_ = true;
+    marked_.clear();
+  }
+
+  bool marking() const { return marking_; }
+
+  // the save failed, the marked records are not needed.
+  void unmark() {
+    marking_ = false;
+    marked_.clear();
+  }
+
+  // the save succeeded, the journal now goes with the saved |file| of |base| and
+  // only has the edits made while it was saved. The old journal is gone because
+  // the session moved to the saved file.
+  void restart(const plx::FilePath& file, const Base& base) {
+    auto path = path_for(file);
+    auto records = std::move(marked_);
+    auto old_path = std::move(path_);
+    close();
+    if (old_path)
+      ::DeleteFileW(old_path->raw());
+    ::DeleteFileW(path.raw());
+    open(path, file, base);
+    pending_.insert(pending_.end(), records.begin(), records.end());
+  }
+
+private:
+  // applies the records in [bytes, bytes + size) to |doc|. Returns the bytes of the
+  // records that are whole and fit the document.
+  static size_t play(const uint8_t* bytes, size_t size, TextStore* doc) {
+    // records and text are multiples of 2 bytes so the text is always aligned.
+    size_t used = 0;
+    while (size - used >= sizeof(Record)) {
+      Record record;
+      memcpy(&record, bytes + used, sizeof(record));
+      auto next = used + sizeof(record);
+      if (record.kind == insert_kind) {
+        if ((record.pos > doc->size()) ||
+            (record.count > (size - next) / sizeof(wchar_t)))
+          break;
+        auto count = static_cast<size_t>(record.count);
+        doc->insert(static_cast<size_t>(record.pos),
+                    reinterpret_cast<const wchar_t*>(bytes + next), count);
+        next += count * sizeof(wchar_t);
+      } else if (record.kind == erase_kind) {
+        if ((record.pos > doc->size()) || (record.count > doc->size() - record.pos))
+          break;
+        doc->erase(static_cast<size_t>(record.pos), static_cast<size_t>(record.count));
+      } else {
+        break;
+      }
+      used = next;
+    }
+    return used;
+  }
+
+  // FNV-1a of the bytes, 8 at a time. It tells files apart, it is not secure.
+  static uint64_t hash_of(plx::File& file) {
+    const size_t block_size = 1024 * 1024;
+    std::unique_ptr<uint8_t[]> block(new uint8_t[block_size]);
+    uint64_t hash = 14695981039346656037ull;
+    for (;;) {
+      auto count = file.read(block.get(), block_size, -1);
+      if (!count)
+        break;
+      size_t ix = 0;
+      for (; ix + sizeof(uint64_t) <= count; ix += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, block.get() + ix, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ull;
+      }
+      for (; ix != count; ++ix)
+        hash = (hash ^ block[ix]) * 1099511628211ull;
+    }
+    return hash;
+  }
+
+  void finish() {
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+  void append(const void* data, size_t size) {
+    auto bytes = reinterpret_cast<const uint8_t*>(data);
+    if (file_ && !failed_)
+      pending_.insert(pending_.end(), bytes, bytes + size);
+    if (marking_)
+      marked_.insert(marked_.end(), bytes, bytes + size);
+  }
+};
+
+const uint32_t EditJournal::magic;
+const uint32_t EditJournal::insert_kind;
+const uint32_t EditJournal::erase_kind;
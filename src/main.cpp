@@ -12,19 +12,16 @@
 // 1.  modified text (like VS ide) side column marker.
 // 2.  column guides (80 cols, etc).
 // 3.  dropbox folder aware.
-// 4.  number of lines.
 // 7.  don't scroll past the bottom.
 // 8.  save to input file.
 // 9.  spellchecker.
 // 13. text stats above text.
 // 14. pg up and pg down.
-// 15. undo / redo.
 // 16. make selection with keyboard only.
 // 17. home to start of line, home again to begin of paragraph.
 // 18. end to end of line, end again to end of paragraph.
 // 19. help screen or pane.
 // 20. ctrl + left / right moves over words.
-// 21. deleting needs to redo the active_text.
 
 template <typename T> int sgn(T val) {
   return (T(0) < val) - (val < T(0));
@@ -32,12 +29,22 @@ template <typename T> int sgn(T val) {
 
 namespace ui_txt {
   const wchar_t no_file_title[] = L"TExTO v0.0.2b <no file> [F2: open]\n";
+  const wchar_t save_none[] = L"";
+  const wchar_t save_busy[] = L" saving...";
+  const wchar_t save_done[] = L" saved";
+  const wchar_t save_failed[] = L" save failed!";
 }
 
-// force plex to generate these two symbols since file_io.h is not fed to
-// the generator yet.
-void* f00 = &plx::UTF8FromUTF16;
-void* f01 = &plx::UTF16FromUTF8;
+// posted by the save thread, wparam is TRUE if the file was written.
+const UINT WM_TEXTO_SAVED = WM_APP + 1;
+// posted by the find thread when it has matches to show.
+const UINT WM_TEXTO_FOUND = WM_APP + 2;
+// posted by the word index thread when it is done.
+const UINT WM_TEXTO_INDEXED = WM_APP + 3;
+// how often the edit journal goes to disk.
+const UINT_PTR journal_timer_id = 1;
+const UINT journal_timer_ms = 1000;
+
 std::list<int> f03;
 
 
@@ -63,14 +70,28 @@ struct Settings {
   std::string user_name;
   int window_width = 1200;
   int window_height = 1000;
+  TextStoreKind text_store = TextStoreKind::piece_table;
+  // rewrite only the changed tail of the file saved last, in place and not
+  // atomically, see PlainTextFileIO::save().
+  bool delta_save = false;
 };
 
 Settings LoadSettings() {
   auto config = plx::JsonFromFile(OpenConfigFile());
   if (config.type() != plx::JsonType::OBJECT)
     throw plx::IOException(__LINE__, L"<unexpected json>");
-  // $$ read & set something here.
-  return Settings();
+  Settings settings;
+  // $$ read & set the rest here.
+  if (config.has_key("text_store")) {
+    auto store = config["text_store"].get_string();
+    if (store == "rope")
+      settings.text_store = TextStoreKind::rope;
+    else if (store != "piece_table")
+      throw plx::IOException(__LINE__, L"<unexpected text_store>");
+  }
+  if (config.has_key("delta_save"))
+    settings.delta_save = config["delta_save"].get_bool();
+  return settings;
 }
 
 const D2D1_SIZE_F zero_offset = {0};
@@ -140,19 +161,48 @@ class DCoWindow : public plx::Window <DCoWindow> {
   plx::D2D1BrushManager text_brushes_;
   plx::ComPtr<IDWriteTextLayout> title_layout_;
   std::unique_ptr<plx::FilePath> file_path_;
+  // how the lines of the file ended, saving puts them back the same way.
+  LineEnding line_ending_;
   std::unique_ptr<TextView> textview_;
 
+  // what the saved file is for the journal, set by the save thread. It goes
+  // before |saver_| so it outlives the thread.
+  EditJournal::Base save_base_;
+  BackgroundSave saver_;
+  const wchar_t* save_status_;
+  // where the save in progress goes and what it did not change.
+  std::unique_ptr<plx::FilePath> save_path_;
+  size_t save_unchanged_;
+  // true if |file_path_| was written by the last save, so the next save can keep
+  // the part of it that did not change.
+  bool saved_file_;
+  // true if the document decodes from a mapping of |file_path_|, which a save must
+  // never rewrite in place.
+  bool mapped_file_;
+  EditJournal journal_;
+
   std::unique_ptr<FindControl> find_ctrl_;
 
   FocusManager focus_manager_;
 
+  const TextStoreKind text_store_kind_;
+  const bool delta_save_;
+
 public:
-  DCoWindow(int width, int height)
+  DCoWindow(int width, int height, TextStoreKind text_store_kind, bool delta_save)
       : width_(width), height_(height),
         scroll_v_(0.0f),
         scale_(D2D1::Matrix3x2F::Scale(1.0f, 1.0f)),
         brushes_(brush_last),
-        text_brushes_(TextView::brush_last) {
+        text_brushes_(TextView::brush_last),
+        line_ending_(LineEnding::lf),
+        save_base_(),
+        save_status_(ui_txt::save_none),
+        save_unchanged_(0),
+        saved_file_(false),
+        mapped_file_(false),
+        text_store_kind_(text_store_kind),
+        delta_save_(delta_save) {
 
     // $$ read from config.
     margin_tl_ = D2D1::Point2F(22.0f, 36.0f);
@@ -236,8 +286,9 @@ public:
       text_brushes_.set_solid(dc(), TextView::brush_find, 0x9A2ED2, 0.7f);
     }
 
-    make_textview(nullptr);
+    make_textview(MakeTextStore(text_store_kind_, nullptr));
     update_screen();
+    ::SetTimer(window(), journal_timer_id, journal_timer_ms, nullptr);
   }
 
   void update_title(std::wstring& title) {
@@ -255,7 +306,9 @@ public:
     std::wstring title(
         L"cur: " + std::to_wstring(textview_->cursor()) +
         L" pos: " + std::to_wstring(textview_->start()) +
-        L" scale: " + std::to_wstring(scale_._11).substr(0, 4) +  L"  ");
+        L" lines: " + std::to_wstring(textview_->line_count()) +
+        L" words: " + std::to_wstring(textview_->word_count()) +
+        L" scale: " + std::to_wstring(scale_._11).substr(0, 4) + save_status_ + L"  ");
     if (!file_path_) {
       title += ui_txt::no_file_title;
     } else {
@@ -359,11 +412,51 @@ public:
       case WM_DPICHANGED: {
         return dpi_changed_handler(lparam);
       }
+      case WM_TEXTO_SAVED: {
+        return saved_handler(wparam == TRUE);
+      }
+      case WM_TEXTO_FOUND: {
+        if (textview_->find_progress())
+          update_screen();
+        return 0;
+      }
+      case WM_TEXTO_INDEXED: {
+        textview_->words_indexed();
+        update_screen();
+        return 0;
+      }
+      case WM_TIMER: {
+        if (wparam == journal_timer_id)
+          journal_.flush();
+        return 0;
+      }
     }
 
     return ::DefWindowProc(window(), message, wparam, lparam);
   }
 
+  LRESULT saved_handler(bool success) {
+    saver_.finish();
+    save_status_ = success ? ui_txt::save_done : ui_txt::save_failed;
+    // unless another file was loaded meanwhile, the session is now the saved file.
+    if (journal_.marking()) {
+      if (success) {
+        file_path_ = std::move(save_path_);
+        journal_.restart(*file_path_, save_base_);
+      } else {
+        journal_.unmark();
+        textview_->set_changed_from(save_unchanged_);
+      }
+      // a failed save can leave anything in the file. A good one replaced it, the
+      // mapped file if there was one is not at |file_path_| anymore.
+      saved_file_ = success;
+      if (success)
+        mapped_file_ = false;
+    }
+    update_screen();
+    return 0L;
+  }
+
   void paint_handler() {
     // just recovery here when using direct composition.
   }
@@ -402,6 +495,14 @@ public:
       case 0x16:                  // ctrl-v.
         clipboard_paste();
         break;
+      case 0x19:                  // ctrl-y.
+        if (textview_->redo())
+          update_screen();
+        break;
+      case 0x1A:                  // ctrl-z.
+        if (textview_->undo())
+          update_screen();
+        break;
       default:
         ; // $$$ beep or flash.
     }
@@ -518,21 +619,59 @@ public:
 
     }
     if (command_id == IDC_SAVE_PLAINTEXT) {
+      // one save at a time.
+      if (saver_.busy())
+        return 0L;
       FileSaveDialog dialog(window());
       if (!dialog.success())
         return 0L;
 
-      PlainTextFileIO ptfio(dialog.path());
-      ptfio.save(textview_->get_full_text());
-      return 0L;
+      // the unchanged text can be kept only if it is the file saved last time, and
+      // only if the user traded the atomic save for it.
+      save_unchanged_ = textview_->take_changed_from();
+      auto same_file = file_path_ && (std::wstring(file_path_->raw()) == dialog.path().raw());
+      auto delta = delta_save_ && saved_file_ && same_file && !mapped_file_;
+      auto unchanged = delta ? save_unchanged_ : 0;
+      auto path = dialog.path();
+      saver_.start(window(), WM_TEXTO_SAVED, path, textview_->snapshot(),
+                   line_ending_, unchanged, [this, path]() {
+        save_base_ = EditJournal::base_of(path);
+      });
+      save_status_ = ui_txt::save_busy;
+      save_path_ = std::make_unique<plx::FilePath>(dialog.path());
+      journal_.mark();
     }
     if (command_id == IDC_LOAD_PLAINTEXT) {
       FileOpenDialog dialog(window());
       if (!dialog.success())
         return 0L;
       
+      journal_.close();
+      std::unique_ptr<TextStore> document;
       PlainTextFileIO ptfio(dialog.path());
-      make_textview(ptfio.load().release());
+      mapped_file_ = ptfio.is_large();
+      if (mapped_file_) {
+        // always a piece table, it is the one that can use the mapped file.
+        line_ending_ = ptfio.map(&document);
+      } else {
+        document = MakeTextStore(text_store_kind_, nullptr);
+        line_ending_ = ptfio.load(document.get());
+      }
+      // whatever was not saved the last time the file was open.
+      auto journal_path = EditJournal::path_for(dialog.path());
+      // the hash is known if this is the file saved last.
+      auto base = EditJournal::stamp_of(dialog.path());
+      if (saved_file_ && (std::wstring(file_path_->raw()) == dialog.path().raw()) &&
+          (base.size == save_base_.size) && (base.write_time == save_base_.write_time))
+        base.hash = save_base_.hash;
+      bool appendable = true;
+      if (!EditJournal::replay(journal_path, dialog.path(), &base, document.get(), &appendable))
+        ::DeleteFileW(journal_path.raw());
+      make_textview(std::move(document));
+      // a journal that could not be cut keeps what it has for next time.
+      if (appendable)
+        journal_.open(journal_path, dialog.path(), base);
+      saved_file_ = false;
       
       file_path_ = std::make_unique<plx::FilePath>(dialog.path());
     }
@@ -550,8 +689,14 @@ public:
     textview_->set_size(w, static_cast<uint32_t>(h));
   }
 
-  void make_textview(std::wstring* text) {
-    textview_ = std::make_unique<TextView>(dwrite_factory_, text_fmt_[fmt_mono_text], text);
+  void make_textview(std::unique_ptr<TextStore> document) {
+    textview_ = std::make_unique<TextView>(
+        dwrite_factory_, text_fmt_[fmt_mono_text], std::move(document));
+    textview_->set_journal(&journal_);
+    textview_->set_find_notify(window(), WM_TEXTO_FOUND);
+    textview_->index_words(window(), WM_TEXTO_INDEXED, !mapped_file_);
+    if (find_ctrl_)
+      find_ctrl_->set_textview(textview_.get());
     set_textview_size();
   }
 
@@ -576,7 +721,8 @@ public:
     if (find_ctrl_) {
       focus_manager_.remove_target(find_ctrl_.get());
       find_ctrl_.reset();
-      textview_->clear_find();
+      // the next control starts literal, and so does select_word().
+      textview_->set_find_mode(TextFinder::literal);
       return;
     }
     // create and show the control.
@@ -649,7 +795,8 @@ int __stdcall wWinMain(HINSTANCE instance, HINSTANCE,
                        wchar_t* cmdline, int cmd_show) {
   try {
     auto settings = LoadSettings();
-    DCoWindow window(settings.window_width, settings.window_height);
+    DCoWindow window(settings.window_width, settings.window_height, settings.text_store,
+                     settings.delta_save);
 
     auto accel_table = LoadAccelerators();
 
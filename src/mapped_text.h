@@ -0,0 +1,228 @@
+// TExTO.  Copyright 2014, Carlos Pizano (carlos.pizano@gmail.com)
+// TExTO is a text editor prototype. This is the memory mapped file that backs
+// the piece table when the file is too big to read.
+
+#pragma once
+#include "stdafx.h"
+#include "text_store.h"
+#include "utf8_codec.h"
+#include <mutex>
+
+// The file is mapped read-only and scanned once, a chunk at a time, decoding into a
+// scratch buffer to learn where each chunk lands in UTF-16. The scan also hands the
+// decoded text to the caller so it can index it. Only the chunk being decoded is
+// mapped, a view of it is made and dropped each time, so the file never needs its
+// size in address space.
+//
+// The decoded text lives in address ranges reserved for the whole document, but
+// their pages are only committed and filled when ensure() asks for them, so memory
+// grows with the parts of the file that have been viewed and not with its size.
+// The ranges are Regions of at most |region_size| units, each reserved on its own,
+// so no single free range of twice the file size is needed, which a 32-bit process
+// seldom has. A region ends at a chunk boundary and a piece of text never spans two.
+// The CRs are removed like the regular loader does.
+//
+// The file stays open and mapped for as long as the document lives, the pieces
+// that did not change still decode from it. Saving over it must not touch its
+// bytes, so it is shared for delete: the save writes a new file and renames it
+// over this one, which stays alive under the open handle until the document goes.
+class MappedText {
+  static const size_t chunk_bytes = 64 * 1024;
+  static const size_t region_size = 32 * 1024 * 1024;
+
+  struct Chunk {
+    // where the chunk starts in the file and in the decoded text.
+    uint64_t byte_offset;
+    size_t offset;
+    bool decoded;
+  };
+
+  struct Region {
+    // where the region starts in the decoded text, its size and its address range.
+    size_t offset;
+    size_t size;
+    wchar_t* text;
+  };
+
+  // [from, to) of the file mapped, while it lives.
+  class View {
+    const void* base_;
+    const uint8_t* bytes_;
+
+    View& operator=(const View&) = delete;
+    View(const View&) = delete;
+
+  public:
+    View(HANDLE mapping, uint64_t from, uint64_t to, DWORD granularity) {
+      // views start at a multiple of the allocation granularity.
+      auto start = from - (from % granularity);
+      base_ = ::MapViewOfFile(mapping, FILE_MAP_READ,
+                              static_cast<DWORD>(start >> 32), static_cast<DWORD>(start),
+                              static_cast<size_t>(to - start));
+      if (!base_)
+        throw plx::IOException(__LINE__, nullptr);
+      bytes_ = static_cast<const uint8_t*>(base_) + (from - start);
+    }
+
+    ~View() {
+      ::UnmapViewOfFile(base_);
+    }
+
+    const uint8_t* bytes() const { return bytes_; }
+  };
+
+  HANDLE file_;
+  HANDLE mapping_;
+  DWORD granularity_;
+  uint64_t byte_size_;
+  size_t size_;
+  // all the chunks plus one that marks the end.
+  std::vector<Chunk> chunks_;
+  std::vector<Region> regions_;
+  // a decoded chunk, with room for the sequence that ends it.
+  std::unique_ptr<wchar_t[]> scratch_;
+  plx::CRStats cr_stats_;
+  // the save thread can decode too.
+  std::mutex lock_;
+
+  MappedText& operator=(const MappedText&) = delete;
+  MappedText(const MappedText&) = delete;
+
+public:
+  explicit MappedText(const plx::FilePath& path)
+      : file_(INVALID_HANDLE_VALUE), mapping_(nullptr), granularity_(0), byte_size_(0),
+        size_(0),
+        scratch_(new wchar_t[chunk_bytes + 4]) {
+    // the destructor does not run if the constructor throws, an open file left
+    // behind would keep others from writing it.
+    try {
+      open(path);
+    } catch (...) {
+      close();
+      throw;
+    }
+  }
+
+  ~MappedText() {
+    close();
+  }
+
+  // decodes the whole file once, |fn| sees each decoded chunk. It must be called
+  // before anything else.
+  void scan(const TextSource::ChunkFn& fn) {
+    uint64_t pos = 0;
+    Region region = { 0, 0, nullptr };
+    while (pos != byte_size_) {
+      Chunk chunk = { pos, size_, false };
+      // the sequence that ends the chunk can take 3 more bytes.
+      View view(mapping_, pos, std::min(pos + chunk_bytes + 3, byte_size_), granularity_);
+      auto end = next_boundary(view.bytes(), pos);
+      auto count = decode(view.bytes(), static_cast<size_t>(end - pos), &cr_stats_);
+      if (region.size && (region.size + count > region_size)) {
+        regions_.push_back(region);
+        region.offset = size_;
+        region.size = 0;
+      }
+      chunks_.push_back(chunk);
+      fn(size_, scratch_.get(), count);
+      size_ += count;
+      region.size += count;
+      pos = end;
+    }
+    Chunk end = { byte_size_, size_, true };
+    chunks_.push_back(end);
+    if (region.size)
+      regions_.push_back(region);
+    for (auto& r : regions_) {
+      r.text = static_cast<wchar_t*>(
+          ::VirtualAlloc(nullptr, r.size * sizeof(wchar_t), MEM_RESERVE, PAGE_READWRITE));
+      if (!r.text)
+        throw plx::IOException(__LINE__, nullptr);
+    }
+  }
+
+  size_t size() const { return size_; }
+  const plx::CRStats& cr_stats() const { return cr_stats_; }
+
+  // calls |fn| with the (text, size) of each region, in order. Only the parts
+  // passed to ensure() can be read.
+  template <typename Fn>
+  void for_each_region(const Fn& fn) const {
+    for (auto& region : regions_)
+      fn(static_cast<const wchar_t*>(region.text), region.size);
+  }
+
+  // makes [text, text + count) readable if it is in one of the regions.
+  void ensure(const wchar_t* text, size_t count) {
+    auto region = std::find_if(regions_.begin(), regions_.end(), [text](const Region& r) {
+      return (text >= r.text) && (text < r.text + r.size);
+    });
+    if (region == regions_.end())
+      return;
+    auto pos = region->offset + (text - region->text);
+    std::lock_guard<std::mutex> lock(lock_);
+    auto it = std::upper_bound(chunks_.begin(), chunks_.end(), pos,
+        [](size_t offset, const Chunk& chunk) { return offset < chunk.offset; });
+    for (--it; it->offset < pos + count; ++it) {
+      if (it->decoded)
+        continue;
+      auto next = it + 1;
+      auto len = next->offset - it->offset;
+      if (len) {
+        auto dest = region->text + (it->offset - region->offset);
+        if (!::VirtualAlloc(dest, len * sizeof(wchar_t), MEM_COMMIT, PAGE_READWRITE))
+          throw plx::IOException(__LINE__, nullptr);
+        // a chunk decodes to the same text every time, the stats don't matter.
+        View view(mapping_, it->byte_offset, next->byte_offset, granularity_);
+        plx::CRStats cr_stats;
+        decode(view.bytes(), static_cast<size_t>(next->byte_offset - it->byte_offset), &cr_stats);
+        std::copy(scratch_.get(), scratch_.get() + len, dest);
+      }
+      it->decoded = true;
+    }
+  }
+
+private:
+  void open(const plx::FilePath& path) {
+    file_ = ::CreateFileW(path.raw(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                          OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE)
+      throw plx::IOException(__LINE__, path.raw());
+    LARGE_INTEGER size = {0};
+    ::GetFileSizeEx(file_, &size);
+    byte_size_ = size.QuadPart;
+    if (!byte_size_)
+      return;
+    mapping_ = ::CreateFileMappingW(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping_)
+      throw plx::IOException(__LINE__, path.raw());
+    SYSTEM_INFO si;
+    ::GetSystemInfo(&si);
+    granularity_ = si.dwAllocationGranularity;
+  }
+
+  void close() {
+    for (auto& region : regions_) {
+      if (region.text)
+        ::VirtualFree(region.text, 0, MEM_RELEASE);
+    }
+    if (mapping_)
+      ::CloseHandle(mapping_);
+    if (file_ != INVALID_HANDLE_VALUE)
+      ::CloseHandle(file_);
+  }
+
+  // chunks end at the next multiple of |chunk_bytes| but never in the middle of
+  // a multi-byte sequence. |bytes| is the file from |pos| on.
+  uint64_t next_boundary(const uint8_t* bytes, uint64_t pos) const {
+    auto end = std::min(pos + chunk_bytes, byte_size_);
+    for (int ix = 0; (ix != 3) && (end != byte_size_) && ((bytes[end - pos] & 0xC0) == 0x80); ++ix)
+      ++end;
+    return end;
+  }
+
+  size_t decode(const uint8_t* bytes, size_t count, plx::CRStats* cr_stats) {
+    plx::Range<const uint8_t> utf8(bytes, count);
+    return plx::DecodeUTF8StripCR(utf8, reinterpret_cast<uint16_t*>(scratch_.get()), false, cr_stats);
+  }
+};
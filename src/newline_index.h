@@ -0,0 +1,88 @@
+// TExTO.  Copyright 2014, Carlos Pizano (carlos.pizano@gmail.com)
+// TExTO is a text editor prototype. This is the index of line feeds used by
+// the piece table to answer line queries.
+
+#pragma once
+#include "stdafx.h"
+
+// Keeps the sorted offsets of every LF in the document. It works like a gap buffer:
+// |head_| has the offsets before the last edit and |tail_| the ones after it, in
+// reverse order and without |tail_delta_|, which is how much the text has grown
+// at the gap. Typing only touches the end of the two vectors and adjusts the delta,
+// so the offsets after the edit point are shifted without being rewritten. Moving
+// to another place costs the number of LFs in between. Lookups are binary searches.
+class NewlineIndex {
+  std::vector<size_t> head_;
+  std::vector<size_t> tail_;
+  ptrdiff_t tail_delta_;
+
+public:
+  NewlineIndex() : tail_delta_(0) {}
+
+  // the number of LFs.
+  size_t size() const { return head_.size() + tail_.size(); }
+
+  // the offset of the |ix|th LF.
+  size_t at(size_t ix) const {
+    if (ix < head_.size())
+      return head_[ix];
+    return tail_at(tail_.size() - 1 - (ix - head_.size()));
+  }
+
+  // the number of LFs before |pos|, which is also the line that contains |pos|.
+  size_t count_before(size_t pos) const {
+    size_t lo = 0;
+    size_t hi = size();
+    while (lo < hi) {
+      auto mid = lo + (hi - lo) / 2;
+      if (at(mid) < pos)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    return lo;
+  }
+
+  // |pos| is the offset of the first character of |text|.
+  void append(size_t pos, const wchar_t* text, size_t count) {
+    move_gap(std::numeric_limits<size_t>::max());
+    add_newlines(pos, text, count);
+  }
+
+  void insert(size_t pos, const wchar_t* text, size_t count) {
+    move_gap(pos);
+    add_newlines(pos, text, count);
+    tail_delta_ += static_cast<ptrdiff_t>(count);
+  }
+
+  void erase(size_t pos, size_t count) {
+    move_gap(pos);
+    while (!tail_.empty() && (tail_at(tail_.size() - 1) < pos + count))
+      tail_.pop_back();
+    tail_delta_ -= static_cast<ptrdiff_t>(count);
+  }
+
+private:
+  size_t tail_at(size_t ix) const {
+    return tail_[ix] + static_cast<size_t>(tail_delta_);
+  }
+
+  void add_newlines(size_t pos, const wchar_t* text, size_t count) {
+    for (size_t ix = 0; ix != count; ++ix) {
+      if (text[ix] == L'\n')
+        head_.push_back(pos + ix);
+    }
+  }
+
+  // after this call |head_| has exactly the LFs before |pos|.
+  void move_gap(size_t pos) {
+    while (!head_.empty() && (head_.back() >= pos)) {
+      tail_.push_back(head_.back() - static_cast<size_t>(tail_delta_));
+      head_.pop_back();
+    }
+    while (!tail_.empty() && (tail_at(tail_.size() - 1) < pos)) {
+      head_.push_back(tail_at(tail_.size() - 1));
+      tail_.pop_back();
+    }
+  }
+};
@@ -0,0 +1,394 @@
+// TExTO.  Copyright 2014, Carlos Pizano (carlos.pizano@gmail.com)
+// TExTO is a text editor prototype. This is the piece table that stores
+// the document.
+
+#pragma once
+#include "stdafx.h"
+#include "text_store.h"
+#include "newline_index.h"
+#include "mapped_text.h"
+
+// The text as loaded from disk lives in the original buffer and is never modified.
+// Every character typed or pasted since then is appended to the append blocks,
+// which only grow and never move. The document is the concatenation of the pieces,
+// each one a span of those buffers, so an edit only splits, trims or removes pieces.
+// The cost of an edit depends on the number of pieces and never on the size of the
+// document. Line queries are answered by |newlines_|, which is updated on every edit.
+//
+// Pieces are grouped in blocks shared copy-on-write with the versions returned by
+// snapshot(), so a version costs a pointer and the first edit after it copies the
+// list of blocks and the block it changes.
+//
+// For files too big to read the original buffer is a MappedText instead, which
+// decodes on demand. Every read of the original asks it to decode first.
+class PieceTable : public TextStore {
+  static const size_t block_max = 64;
+  static const size_t append_block_size = 64 * 1024;
+
+  // a span of text in one of the buffers.
+  struct Piece {
+    const wchar_t* text;
+    size_t length;
+
+    Piece(const wchar_t* text, size_t length) : text(text), length(length) {}
+  };
+
+  struct PieceBlock {
+    std::vector<Piece> pieces;
+    // sum of the lengths of |pieces|.
+    size_t length;
+
+    PieceBlock() : length(0) {}
+  };
+
+  typedef std::vector<std::shared_ptr<PieceBlock>> PieceList;
+
+  // the text the pieces point to. Nothing in here moves or changes once written.
+  struct Buffers {
+    std::wstring original;
+    std::unique_ptr<MappedText> mapped;
+    std::vector<std::unique_ptr<wchar_t[]>> append;
+
+    // makes |text| readable if it points to the mapped original.
+    void prepare(const wchar_t* text, size_t count) const {
+      if (mapped)
+        mapped->ensure(text, count);
+    }
+  };
+
+  // where a character is: block, piece in the block and offset in the piece.
+  struct Location {
+    size_t block;
+    size_t piece;
+    size_t offset;
+  };
+
+  class Snapshot : public TextSource {
+    friend class PieceTable;
+    const std::shared_ptr<const Buffers> buffers_;
+    const std::shared_ptr<PieceList> pieces_;
+    const size_t size_;
+
+  public:
+    Snapshot(std::shared_ptr<const Buffers> buffers,
+             std::shared_ptr<PieceList> pieces, size_t size)
+        : buffers_(buffers), pieces_(pieces), size_(size) {}
+
+    size_t size() const override { return size_; }
+
+    void for_each_chunk(size_t from, size_t to, const ChunkFn& fn) const override {
+      chunks(*buffers_, *pieces_, from, std::min(to, size_), fn);
+    }
+  };
+
+  std::shared_ptr<Buffers> buffers_;
+  // where the next character goes in the last append block and how many fit.
+  wchar_t* append_next_;
+  size_t append_left_;
+  std::shared_ptr<PieceList> pieces_;
+  // sum of the lengths of all pieces.
+  size_t size_;
+  // where the LFs are.
+  NewlineIndex newlines_;
+
+  PieceTable& operator=(const PieceTable&) = delete;
+  PieceTable(const PieceTable&) = delete;
+
+public:
+  explicit PieceTable(std::unique_ptr<std::wstring> text)
+      : buffers_(std::make_shared<Buffers>()),
+        append_next_(nullptr), append_left_(0),
+        pieces_(std::make_shared<PieceList>()),
+        size_(0) {
+    auto& original = buffers_->original;
+    if (text)
+      original.swap(*text);
+    if (!original.empty()) {
+      auto block = std::make_shared<PieceBlock>();
+      block->pieces.emplace_back(original.c_str(), original.size());
+      block->length = original.size();
+      pieces_->push_back(block);
+    }
+    size_ = original.size();
+    newlines_.append(0, original.c_str(), original.size());
+  }
+
+  // the original is |mapped|, only the LFs are found upfront.
+  explicit PieceTable(std::unique_ptr<MappedText> mapped)
+      : buffers_(std::make_shared<Buffers>()),
+        append_next_(nullptr), append_left_(0),
+        pieces_(std::make_shared<PieceList>()),
+        size_(0) {
+    mapped->scan([this](size_t pos, const wchar_t* text, size_t len) {
+      newlines_.append(pos, text, len);
+      return true;
+    });
+    // a piece per region, so no piece spans two.
+    mapped->for_each_region([this](const wchar_t* text, size_t size) {
+      if (pieces_->empty() || (pieces_->back()->pieces.size() == block_max / 2))
+        pieces_->push_back(std::make_shared<PieceBlock>());
+      auto block = pieces_->back().get();
+      block->pieces.emplace_back(text, size);
+      block->length += size;
+    });
+    size_ = mapped->size();
+    buffers_->mapped = std::move(mapped);
+  }
+
+  size_t size() const override { return size_; }
+
+  wchar_t char_at(size_t pos) const override {
+    if (pos >= size_)
+      throw plx::RangeException(__LINE__, nullptr);
+    auto loc = locate(pos);
+    auto text = (*pieces_)[loc.block]->pieces[loc.piece].text + loc.offset;
+    buffers_->prepare(text, 1);
+    return *text;
+  }
+
+  void insert(size_t pos, const wchar_t* text, size_t count) override {
+    if (pos > size_)
+      throw plx::RangeException(__LINE__, nullptr);
+    if (!count)
+      return;
+
+    newlines_.insert(pos, text, count);
+    size_ += count;
+
+    if (pieces_->empty())
+      writable_list()->push_back(std::make_shared<PieceBlock>());
+    auto loc = locate(pos);
+
+    // typing at the end of the last edit just grows the piece that holds it.
+    if ((loc.offset == 0) && (count <= append_left_) && (loc.piece || loc.block)) {
+      auto prev = previous(loc);
+      const auto& piece = (*pieces_)[prev.block]->pieces[prev.piece];
+      if (piece.text + piece.length == append_next_) {
+        append_text(text, count);
+        auto block = writable_block(prev.block);
+        block->pieces[prev.piece].length += count;
+        block->length += count;
+        return;
+      }
+    }
+
+    Piece piece(append_text(text, count), count);
+    auto block = writable_block(loc.block);
+    auto& pieces = block->pieces;
+    if (loc.offset == 0) {
+      pieces.insert(pieces.begin() + loc.piece, piece);
+    } else {
+      // split the piece at |offset| and put the new one in the middle.
+      auto& old = pieces[loc.piece];
+      Piece tail(old.text + loc.offset, old.length - loc.offset);
+      old.length = loc.offset;
+      Piece both[] = { piece, tail };
+      pieces.insert(pieces.begin() + loc.piece + 1, both, both + 2);
+    }
+    block->length += count;
+    split_block(loc.block);
+  }
+
+  void erase(size_t pos, size_t count) override {
+    if (pos + count > size_)
+      throw plx::RangeException(__LINE__, nullptr);
+    if (!count)
+      return;
+
+    newlines_.erase(pos, count);
+    size_ -= count;
+
+    // one piece at a time: trim it, split it or drop it.
+    while (count) {
+      auto loc = locate(pos);
+      auto block = writable_block(loc.block);
+      auto& pieces = block->pieces;
+      auto& piece = pieces[loc.piece];
+      auto n = std::min(count, piece.length - loc.offset);
+      if (loc.offset == 0) {
+        if (n == piece.length) {
+          pieces.erase(pieces.begin() + loc.piece);
+        } else {
+          piece.text += n;
+          piece.length -= n;
+        }
+      } else if (loc.offset + n == piece.length) {
+        piece.length = loc.offset;
+      } else {
+        Piece tail(piece.text + loc.offset + n, piece.length - loc.offset - n);
+        piece.length = loc.offset;
+        pieces.insert(pieces.begin() + loc.piece + 1, tail);
+      }
+      block->length -= n;
+      count -= n;
+      if (pieces.empty())
+        pieces_->erase(pieces_->begin() + loc.block);
+      else
+        split_block(loc.block);
+    }
+
+    if (size_)
+      merge_blocks(locate(std::min(pos, size_ - 1)).block);
+  }
+
+  void for_each_chunk(size_t from, size_t to, const ChunkFn& fn) const override {
+    chunks(*buffers_, *pieces_, from, std::min(to, size_), fn);
+  }
+
+  size_t line_count() const override {
+    return newlines_.size() + 1;
+  }
+
+  size_t offset_of_line(size_t line) const override {
+    if (!line)
+      return 0;
+    if (line > newlines_.size())
+      return size_;
+    return newlines_.at(line - 1) + 1;
+  }
+
+  size_t line_of_offset(size_t pos) const override {
+    return newlines_.count_before(pos);
+  }
+
+  std::shared_ptr<const TextSource> snapshot() const override {
+    return std::make_shared<Snapshot>(buffers_, pieces_, size_);
+  }
+
+  void restore(const TextSource& version, size_t lo, size_t hi) override {
+    auto snap = dynamic_cast<const Snapshot*>(&version);
+    if (!snap || (snap->buffers_ != buffers_))
+      throw plx::InvalidParamException(__LINE__, 1);
+    // only the LFs in the span that differs need to be found again.
+    newlines_.erase(lo, hi - lo);
+    auto version_hi = hi + snap->size_ - size_;
+    snap->for_each_chunk(lo, version_hi, [this](size_t pos, const wchar_t* text, size_t len) {
+      newlines_.insert(pos, text, len);
+      return true;
+    });
+    pieces_ = snap->pieces_;
+    size_ = snap->size_;
+  }
+
+private:
+  static void chunks(const Buffers& buffers, const PieceList& list,
+                     size_t from, size_t to, const ChunkFn& fn) {
+    size_t pos = 0;
+    for (const auto& block : list) {
+      if (pos >= to)
+        return;
+      if (pos + block->length <= from) {
+        pos += block->length;
+        continue;
+      }
+      for (const auto& piece : block->pieces) {
+        if (pos >= to)
+          return;
+        if (pos + piece.length > from) {
+          auto offset = (pos < from) ? from - pos : 0;
+          auto len = std::min(piece.length - offset, to - (pos + offset));
+          buffers.prepare(piece.text + offset, len);
+          if (!fn(pos + offset, piece.text + offset, len))
+            return;
+        }
+        pos += piece.length;
+      }
+    }
+  }
+
+  // finds the piece that holds |pos|. For |pos| equal to the size it returns one
+  // past the last piece of the last block.
+  Location locate(size_t pos) const {
+    Location loc = {0, 0, 0};
+    const auto& list = *pieces_;
+    if (list.empty())
+      return loc;
+    for (; loc.block != list.size() - 1; ++loc.block) {
+      if (pos < list[loc.block]->length)
+        break;
+      pos -= list[loc.block]->length;
+    }
+    const auto& pieces = list[loc.block]->pieces;
+    for (; loc.piece != pieces.size(); ++loc.piece) {
+      if (pos < pieces[loc.piece].length)
+        break;
+      pos -= pieces[loc.piece].length;
+    }
+    loc.offset = pos;
+    return loc;
+  }
+
+  // the piece before the one at |loc|, which can't be the first one.
+  Location previous(Location loc) const {
+    if (loc.piece) {
+      --loc.piece;
+    } else {
+      --loc.block;
+      loc.piece = (*pieces_)[loc.block]->pieces.size() - 1;
+    }
+    loc.offset = 0;
+    return loc;
+  }
+
+  const wchar_t* append_text(const wchar_t* text, size_t count) {
+    if (count > append_left_) {
+      auto size = std::max(count, append_block_size);
+      buffers_->append.emplace_back(new wchar_t[size]);
+      append_next_ = buffers_->append.back().get();
+      append_left_ = size;
+    }
+    auto start = append_next_;
+    std::copy(text, text + count, append_next_);
+    append_next_ += count;
+    append_left_ -= count;
+    return start;
+  }
+
+  PieceList* writable_list() {
+    if (pieces_.use_count() > 1)
+      pieces_ = std::make_shared<PieceList>(*pieces_);
+    return pieces_.get();
+  }
+
+  PieceBlock* writable_block(size_t ix) {
+    auto& block = (*writable_list())[ix];
+    if (block.use_count() > 1)
+      block = std::make_shared<PieceBlock>(*block);
+    return block.get();
+  }
+
+  // the block at |ix| must be writable already.
+  void split_block(size_t ix) {
+    auto block = (*pieces_)[ix].get();
+    if (block->pieces.size() <= block_max)
+      return;
+    auto half = block->pieces.size() / 2;
+    auto sibling = std::make_shared<PieceBlock>();
+    sibling->pieces.assign(block->pieces.begin() + half, block->pieces.end());
+    block->pieces.erase(block->pieces.begin() + half, block->pieces.end());
+    for (const auto& piece : sibling->pieces)
+      sibling->length += piece.length;
+    block->length -= sibling->length;
+    pieces_->insert(pieces_->begin() + ix + 1, sibling);
+  }
+
+  // joins block |ix| with a neighbor if both fit in one block, so many erases
+  // don't leave lots of tiny blocks behind.
+  void merge_blocks(size_t ix) {
+    const auto& list = *pieces_;
+    if (ix && (list[ix - 1]->pieces.size() + list[ix]->pieces.size() <= block_max))
+      --ix;
+    else if ((ix + 1 == list.size()) ||
+             (list[ix]->pieces.size() + list[ix + 1]->pieces.size() > block_max))
+      return;
+    auto right = list[ix + 1];
+    auto block = writable_block(ix);
+    block->pieces.insert(block->pieces.end(), right->pieces.begin(), right->pieces.end());
+    block->length += right->length;
+    pieces_->erase(pieces_->begin() + ix + 1);
+  }
+
+};
+
+const size_t PieceTable::block_max;
+const size_t PieceTable::append_block_size;
@@ -0,0 +1,996 @@
+// TExTO.  Copyright 2014, Carlos Pizano (carlos.pizano@gmail.com)
+// TExTO is a text editor prototype. This is the regular expression engine used
+// by find.
+
+#pragma once
+#include "stdafx.h"
+#include "text_search.h"
+#include <cwctype>
+#include <map>
+
+// The pattern is parsed into a tree, the tree becomes a Thompson NFA and the NFA
+// runs as a DFA that is built lazily: a DFA state is a set of NFA states and its
+// transitions are computed the first time they are needed, then cached. There is no
+// backtracking, a match attempt reads each unit once and the cache has at most
+// |max_states| states, so no pattern can hang the search or take all the memory.
+//
+// Matches never span lines, which is what find wants, so each line is searched on
+// its own and lines can be searched in parallel. The match is the leftmost-longest,
+// matches don't overlap and empty matches are ignored. Attempts start only where a
+// match can: if all the matches start with the same literal the SubstringSearch finds
+// it, otherwise the unit must be one a match can start with.
+//
+// The syntax: literals, '.', classes like [a-z] or [^,;], \d \w \s and their
+// negations, groups with () or (?:), alternation with |, the quantifiers * + ? {n}
+// {n,} {n,m} (a lazy ? after them is accepted, it does not change the longest
+// match) and the assertions ^ $ \b \B. There are no backreferences, a DFA can't
+// have them.
+
+namespace plx {
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::RegexException (thrown when the pattern is not valid)
+// position_ : where in the pattern the problem is.
+//
+class RegexException : public plx::Exception {
+  size_t position_;
+
+public:
+  RegexException(int line, size_t position)
+      : Exception(line, "Regex exception"), position_(position) {
+    PostCtor();
+  }
+  size_t position() const { return position_; }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::Regex
+// insts_ : the NFA, |start_| is where it starts.
+// reverse_insts_ : the NFA of the reversed regex, which can start anywhere.
+// sets_ : the distinct sets of units the NFA matches.
+// class_of_ : the class of each unit. Units of a class are the same for the NFA.
+// accepts_ : for each set, whether each class is in it.
+// prefix_ : the literal all the matches start with, if any.
+// first_ : the classes a match can start with.
+//
+class Regex {
+public:
+  typedef std::vector<std::pair<uint16_t, uint16_t>> UnitRanges;
+
+  enum Assertion {
+    line_start,
+    line_end,
+    word_boundary,
+    not_word_boundary
+  };
+
+  // limits that keep a pattern from taking all the memory.
+  static const int max_repeat = 1000;
+  static const size_t max_insts = 64 * 1024;
+
+private:
+  struct Inst {
+    enum Op { op_chars, op_split, op_jump, op_assert, op_match } op;
+    int out;
+    int out1;
+    // the index in |sets_| for op_chars, the Assertion for op_assert.
+    int arg;
+  };
+
+  struct Node {
+    enum Kind { k_chars, k_concat, k_alt, k_repeat, k_assert } kind;
+    UnitRanges ranges;
+    std::vector<size_t> kids;
+    int min;
+    // -1 is no limit.
+    int max;
+    Assertion assertion;
+  };
+
+  // part of the NFA, |outs| are the (instruction, which out) that go to what
+  // comes next.
+  struct Frag {
+    int start;
+    std::vector<std::pair<int, int>> outs;
+  };
+
+  std::vector<Inst> insts_;
+  int start_;
+  std::vector<Inst> reverse_insts_;
+  int reverse_start_;
+  std::vector<UnitRanges> sets_;
+  std::vector<uint16_t> class_of_;
+  std::vector<bool> class_word_;
+  std::vector<std::vector<bool>> accepts_;
+  std::wstring prefix_;
+  std::vector<bool> first_;
+
+  // only used while compiling.
+  std::wstring pattern_;
+  size_t pos_;
+  std::vector<Node> nodes_;
+  std::map<UnitRanges, int> set_ids_;
+  bool reversed_;
+
+  friend class RegexMatcher;
+
+public:
+  explicit Regex(const std::wstring& pattern)
+      : start_(0), reverse_start_(0), pattern_(pattern), pos_(0), reversed_(false) {
+    auto root = parse_alt();
+    if (pos_ != pattern_.size())
+      throw RegexException(__LINE__, pos_);
+    auto frag = emit(root);
+    patch(frag, add_inst(Inst::op_match));
+    start_ = frag.start;
+
+    // the reversed regex, after any number of units.
+    reversed_ = true;
+    insts_.swap(reverse_insts_);
+    frag = emit(root);
+    patch(frag, add_inst(Inst::op_match));
+    auto any = add_inst(Inst::op_chars,
+        set_id(UnitRanges(1, std::make_pair(uint16_t(0), uint16_t(0xFFFF)))));
+    reverse_start_ = add_inst(Inst::op_split);
+    insts_[reverse_start_].out = frag.start;
+    insts_[reverse_start_].out1 = any;
+    insts_[any].out = reverse_start_;
+    insts_.swap(reverse_insts_);
+
+    make_classes();
+    find_prefix();
+    find_first();
+    nodes_.clear();
+    set_ids_.clear();
+  }
+
+  size_t class_count() const { return class_word_.size(); }
+  const std::wstring& prefix() const { return prefix_; }
+
+private:
+  bool at_end() const { return pos_ == pattern_.size(); }
+  wchar_t peek() const { return pattern_[pos_]; }
+
+  size_t add_node(Node::Kind kind) {
+    Node node;
+    node.kind = kind;
+    node.min = 0;
+    node.max = 0;
+    node.assertion = line_start;
+    nodes_.push_back(node);
+    return nodes_.size() - 1;
+  }
+
+  size_t chars_node(const UnitRanges& ranges) {
+    auto ix = add_node(Node::k_chars);
+    nodes_[ix].ranges = ranges;
+    return ix;
+  }
+
+  size_t assert_node(Assertion assertion) {
+    auto ix = add_node(Node::k_assert);
+    nodes_[ix].assertion = assertion;
+    return ix;
+  }
+
+  size_t parse_alt() {
+    auto first = parse_concat();
+    if (at_end() || (peek() != L'|'))
+      return first;
+    auto alt = add_node(Node::k_alt);
+    nodes_[alt].kids.push_back(first);
+    while (!at_end() && (peek() == L'|')) {
+      ++pos_;
+      auto next = parse_concat();
+      nodes_[alt].kids.push_back(next);
+    }
+    return alt;
+  }
+
+  size_t parse_concat() {
+    auto concat = add_node(Node::k_concat);
+    while (!at_end() && (peek() != L'|') && (peek() != L')')) {
+      auto item = parse_repeat();
+      nodes_[concat].kids.push_back(item);
+    }
+    return concat;
+  }
+
+  size_t parse_repeat() {
+    auto atom = parse_atom();
+    while (!at_end()) {
+      int min, max;
+      auto c = peek();
+      if (c == L'*') {
+        min = 0, max = -1;
+        ++pos_;
+      } else if (c == L'+') {
+        min = 1, max = -1;
+        ++pos_;
+      } else if (c == L'?') {
+        min = 0, max = 1;
+        ++pos_;
+      } else if ((c != L'{') || !parse_counts(&min, &max)) {
+        break;
+      }
+      if (!at_end() && (peek() == L'?'))
+        ++pos_;
+      auto repeat = add_node(Node::k_repeat);
+      nodes_[repeat].kids.push_back(atom);
+      nodes_[repeat].min = min;
+      nodes_[repeat].max = max;
+      atom = repeat;
+    }
+    return atom;
+  }
+
+  // a '{' that is not {n}, {n,} or {n,m} is a literal.
+  bool parse_counts(int* min, int* max) {
+    auto pos = pos_ + 1;
+    int lo, hi;
+    if (!parse_number(&pos, &lo))
+      return false;
+    hi = lo;
+    if ((pos != pattern_.size()) && (pattern_[pos] == L',')) {
+      ++pos;
+      if (!parse_number(&pos, &hi))
+        hi = -1;
+    }
+    if ((pos == pattern_.size()) || (pattern_[pos] != L'}'))
+      return false;
+    if ((lo > max_repeat) || (hi > max_repeat) || ((hi != -1) && (hi < lo)))
+      throw RegexException(__LINE__, pos_);
+    pos_ = pos + 1;
+    *min = lo;
+    *max = hi;
+    return true;
+  }
+
+  bool parse_number(size_t* pos, int* value) {
+    auto start = *pos;
+    *value = 0;
+    for (; (*pos != pattern_.size()) && (pattern_[*pos] >= L'0') && (pattern_[*pos] <= L'9'); ++*pos)
+      *value = std::min(*value * 10 + (pattern_[*pos] - L'0'), max_repeat + 1);
+    return *pos != start;
+  }
+
+  size_t parse_atom() {
+    auto c = pattern_[pos_++];
+    switch (c) {
+      case L'(': {
+        if (!pattern_.compare(pos_, 2, L"?:"))
+          pos_ += 2;
+        auto inner = parse_alt();
+        if (at_end() || (peek() != L')'))
+          throw RegexException(__LINE__, pos_);
+        ++pos_;
+        return inner;
+      }
+      case L'[':
+        return parse_class();
+      case L'.':
+        // lines have no LFs, so anything is anything but a LF.
+        return chars_node(UnitRanges(1, std::make_pair(uint16_t(0), uint16_t(0xFFFF))));
+      case L'^':
+        return assert_node(line_start);
+      case L'$':
+        return assert_node(line_end);
+      case L'\\':
+        return parse_escape();
+      case L'*':
+      case L'+':
+      case L'?':
+        // nothing to repeat.
+        throw RegexException(__LINE__, pos_ - 1);
+      default:
+        return chars_node(UnitRanges(1, std::make_pair(uint16_t(c), uint16_t(c))));
+    }
+  }
+
+  size_t parse_escape() {
+    if (at_end())
+      throw RegexException(__LINE__, pos_);
+    auto c = pattern_[pos_++];
+    if (c == L'b')
+      return assert_node(word_boundary);
+    if (c == L'B')
+      return assert_node(not_word_boundary);
+    UnitRanges ranges;
+    if (!class_escape(c, &ranges)) {
+      auto unit = escaped_unit(c);
+      ranges.emplace_back(unit, unit);
+    }
+    return chars_node(ranges);
+  }
+
+  size_t parse_class() {
+    bool negated = false;
+    if (!at_end() && (peek() == L'^')) {
+      negated = true;
+      ++pos_;
+    }
+    UnitRanges ranges;
+    // a ']' right after the '[' is a literal.
+    for (bool first = true; ; first = false) {
+      if (at_end())
+        throw RegexException(__LINE__, pos_);
+      auto c = pattern_[pos_++];
+      if ((c == L']') && !first)
+        break;
+      uint16_t lo = c;
+      if (c == L'\\') {
+        if (at_end())
+          throw RegexException(__LINE__, pos_);
+        auto e = pattern_[pos_++];
+        if (class_escape(e, &ranges))
+          continue;
+        lo = escaped_unit(e);
+      }
+      // a '-' at the end is a literal.
+      if ((pos_ + 1 < pattern_.size()) && (peek() == L'-') && (pattern_[pos_ + 1] != L']')) {
+        ++pos_;
+        uint16_t hi = pattern_[pos_++];
+        if (hi == L'\\') {
+          if (at_end())
+            throw RegexException(__LINE__, pos_);
+          auto e = pattern_[pos_++];
+          hi = escaped_unit(e);
+        }
+        if (hi < lo)
+          throw RegexException(__LINE__, pos_);
+        ranges.emplace_back(lo, hi);
+      } else {
+        ranges.emplace_back(lo, lo);
+      }
+    }
+    normalize(&ranges);
+    return chars_node(negated ? negate(ranges) : ranges);
+  }
+
+  // \d \w \s and \D \W \S, in a class or not.
+  bool class_escape(wchar_t c, UnitRanges* ranges) {
+    UnitRanges set;
+    switch (c) {
+      case L'd': case L'D':
+        set.emplace_back(L'0', L'9');
+        break;
+      case L'w': case L'W':
+        set = word_units().ranges;
+        break;
+      case L's': case L'S':
+        set.emplace_back(L'\t', L'\r');
+        set.emplace_back(L' ', L' ');
+        set.emplace_back(0xA0, 0xA0);
+        set.emplace_back(0x2000, 0x200A);
+        set.emplace_back(0x202F, 0x202F);
+        set.emplace_back(0x205F, 0x205F);
+        set.emplace_back(0x3000, 0x3000);
+        break;
+      default:
+        return false;
+    }
+    if ((c >= L'A') && (c <= L'Z'))
+      set = negate(set);
+    ranges->insert(ranges->end(), set.begin(), set.end());
+    return true;
+  }
+
+  // the unit an escape like \t, \x41 or \. stands for.
+  uint16_t escaped_unit(wchar_t c) {
+    switch (c) {
+      case L't': return L'\t';
+      case L'n': return L'\n';
+      case L'r': return L'\r';
+      case L'f': return L'\f';
+      case L'v': return L'\v';
+      case L'x': return parse_hex(2);
+      case L'u': return parse_hex(4);
+    }
+    // letters and digits are reserved, \1 would be a backreference.
+    if (is_word(c))
+      throw RegexException(__LINE__, pos_ - 1);
+    return c;
+  }
+
+  uint16_t parse_hex(int digits) {
+    uint16_t value = 0;
+    for (int ix = 0; ix != digits; ++ix) {
+      if (at_end() || !std::iswxdigit(peek()))
+        throw RegexException(__LINE__, pos_);
+      auto c = pattern_[pos_++];
+      auto digit = (c <= L'9') ? c - L'0' : (c | 0x20) - L'a' + 10;
+      value = static_cast<uint16_t>(value * 16 + digit);
+    }
+    return value;
+  }
+
+  static void normalize(UnitRanges* ranges) {
+    std::sort(ranges->begin(), ranges->end());
+    UnitRanges merged;
+    for (const auto& range : *ranges) {
+      if (!merged.empty() && (range.first <= merged.back().second + 1))
+        merged.back().second = std::max(merged.back().second, range.second);
+      else
+        merged.push_back(range);
+    }
+    ranges->swap(merged);
+  }
+
+  static UnitRanges negate(UnitRanges ranges) {
+    normalize(&ranges);
+    UnitRanges negated;
+    size_t next = 0;
+    for (const auto& range : ranges) {
+      if (range.first > next)
+        negated.emplace_back(static_cast<uint16_t>(next), static_cast<uint16_t>(range.first - 1));
+      next = range.second + 1;
+    }
+    if (next != 0x10000)
+      negated.emplace_back(static_cast<uint16_t>(next), uint16_t(0xFFFF));
+    return negated;
+  }
+
+  int add_inst(Inst::Op op, int arg = 0) {
+    if (insts_.size() == max_insts)
+      throw RegexException(__LINE__, pattern_.size());
+    Inst inst = { op, -1, -1, arg };
+    insts_.push_back(inst);
+    return static_cast<int>(insts_.size() - 1);
+  }
+
+  Frag single(int inst) {
+    Frag frag;
+    frag.start = inst;
+    frag.outs.emplace_back(inst, 0);
+    return frag;
+  }
+
+  void patch(const Frag& frag, int target) {
+    for (const auto& out : frag.outs) {
+      auto& inst = insts_[out.first];
+      (out.second ? inst.out1 : inst.out) = target;
+    }
+  }
+
+  // |to| continues with |next|.
+  void append(Frag* to, bool* has, const Frag& next) {
+    if (*has) {
+      patch(*to, next.start);
+      to->outs = next.outs;
+    } else {
+      *to = next;
+      *has = true;
+    }
+  }
+
+  int set_id(const UnitRanges& ranges) {
+    auto it = set_ids_.find(ranges);
+    if (it == set_ids_.end()) {
+      it = set_ids_.insert(std::make_pair(ranges, static_cast<int>(sets_.size()))).first;
+      sets_.push_back(ranges);
+    }
+    return it->second;
+  }
+
+  // with |reversed_| the NFA matches the text backwards.
+  Frag emit(size_t ix) {
+    const auto& node = nodes_[ix];
+    switch (node.kind) {
+      case Node::k_chars:
+        return single(add_inst(Inst::op_chars, set_id(node.ranges)));
+      case Node::k_assert: {
+        auto assertion = node.assertion;
+        if (reversed_ && (assertion == line_start))
+          assertion = line_end;
+        else if (reversed_ && (assertion == line_end))
+          assertion = line_start;
+        return single(add_inst(Inst::op_assert, assertion));
+      }
+      case Node::k_concat: {
+        Frag frag;
+        bool has = false;
+        if (reversed_) {
+          for (auto it = node.kids.rbegin(); it != node.kids.rend(); ++it)
+            append(&frag, &has, emit(*it));
+        } else {
+          for (auto kid : node.kids)
+            append(&frag, &has, emit(kid));
+        }
+        return has ? frag : single(add_inst(Inst::op_jump));
+      }
+      case Node::k_alt: {
+        // split(a, split(b, c)).
+        auto frag = emit(node.kids.back());
+        for (auto it = node.kids.rbegin() + 1; it != node.kids.rend(); ++it) {
+          auto kid = emit(*it);
+          auto split = add_inst(Inst::op_split);
+          insts_[split].out = kid.start;
+          insts_[split].out1 = frag.start;
+          kid.outs.insert(kid.outs.end(), frag.outs.begin(), frag.outs.end());
+          kid.start = split;
+          frag = kid;
+        }
+        return frag;
+      }
+      case Node::k_repeat: {
+        // x{2,4} becomes xxx?x?, each copy with its own states.
+        Frag frag;
+        bool has = false;
+        for (int ix = 0; ix != node.min; ++ix)
+          append(&frag, &has, emit(node.kids[0]));
+        if (node.max == -1) {
+          auto split = add_inst(Inst::op_split);
+          auto body = emit(node.kids[0]);
+          insts_[split].out = body.start;
+          patch(body, split);
+          Frag loop;
+          loop.start = split;
+          loop.outs.emplace_back(split, 1);
+          append(&frag, &has, loop);
+        } else {
+          for (int ix = node.min; ix != node.max; ++ix) {
+            auto split = add_inst(Inst::op_split);
+            auto body = emit(node.kids[0]);
+            insts_[split].out = body.start;
+            body.start = split;
+            body.outs.emplace_back(split, 1);
+            append(&frag, &has, body);
+          }
+        }
+        return has ? frag : single(add_inst(Inst::op_jump));
+      }
+    }
+    __debugbreak();
+    return Frag();
+  }
+
+  // units between two cuts are the same for every set and for \b, and units
+  // that are in the same sets share the class.
+  void make_classes() {
+    std::vector<bool> cut(0x10001);
+    cut[0] = true;
+    cut[0x10000] = true;
+    for (const auto& set : sets_) {
+      for (const auto& range : set) {
+        cut[range.first] = true;
+        cut[range.second + 1] = true;
+      }
+    }
+    for (const auto& range : word_units().ranges) {
+      cut[range.first] = true;
+      cut[range.second + 1] = true;
+    }
+
+    std::map<std::vector<bool>, uint16_t> ids;
+    class_of_.resize(0x10000);
+    for (size_t u = 0; u != 0x10000; ) {
+      auto end = u + 1;
+      while (!cut[end])
+        ++end;
+      std::vector<bool> signature;
+      for (const auto& set : sets_)
+        signature.push_back(contains(set, static_cast<uint16_t>(u)));
+      signature.push_back(is_word(static_cast<uint16_t>(u)));
+      auto it = ids.find(signature);
+      if (it == ids.end()) {
+        it = ids.insert(std::make_pair(signature, static_cast<uint16_t>(class_word_.size()))).first;
+        class_word_.push_back(is_word(static_cast<uint16_t>(u)));
+        accepts_.resize(sets_.size());
+        for (size_t set = 0; set != sets_.size(); ++set)
+          accepts_[set].push_back(signature[set]);
+      }
+      std::fill(class_of_.begin() + u, class_of_.begin() + end, it->second);
+      u = end;
+    }
+  }
+
+  struct WordUnits {
+    std::vector<bool> word;
+    // the same as ranges of units, sorted.
+    UnitRanges ranges;
+  };
+
+  // the units of \w and \b, the same for every regex so they are found once. The
+  // first regex is compiled by the window before any search thread can read them.
+  static const WordUnits& word_units() {
+    static WordUnits units;
+    if (units.word.empty()) {
+      units.word.resize(0x10000);
+      for (size_t u = 0; u != 0x10000; ++u)
+        units.word[u] = (u == L'_') || (std::iswalnum(static_cast<wint_t>(u)) != 0);
+      for (size_t u = 0; u != 0x10000; ) {
+        if (!units.word[u]) {
+          ++u;
+          continue;
+        }
+        auto lo = u;
+        while ((u != 0x10000) && units.word[u])
+          ++u;
+        units.ranges.emplace_back(static_cast<uint16_t>(lo), static_cast<uint16_t>(u - 1));
+      }
+    }
+    return units;
+  }
+
+  static bool is_word(uint16_t unit) {
+    return word_units().word[unit];
+  }
+
+  static bool contains(const UnitRanges& set, uint16_t unit) {
+    auto it = std::upper_bound(set.begin(), set.end(), std::make_pair(unit, uint16_t(0xFFFF)));
+    return (it != set.begin()) && ((it - 1)->second >= unit);
+  }
+
+  // the units every path from the start must match first, assertions take no
+  // units.
+  void find_prefix() {
+    std::vector<bool> seen(insts_.size());
+    for (auto pc = start_; (pc >= 0) && !seen[pc]; ) {
+      seen[pc] = true;
+      const auto& inst = insts_[pc];
+      if ((inst.op == Inst::op_jump) || (inst.op == Inst::op_assert)) {
+        pc = inst.out;
+        continue;
+      }
+      if (inst.op != Inst::op_chars)
+        break;
+      const auto& set = sets_[inst.arg];
+      if ((set.size() != 1) || (set[0].first != set[0].second))
+        break;
+      prefix_.push_back(set[0].first);
+      pc = inst.out;
+    }
+  }
+
+  void find_first() {
+    first_.resize(class_word_.size());
+    std::vector<bool> seen(insts_.size());
+    std::vector<int> stack(1, start_);
+    while (!stack.empty()) {
+      auto pc = stack.back();
+      stack.pop_back();
+      if (seen[pc])
+        continue;
+      seen[pc] = true;
+      const auto& inst = insts_[pc];
+      switch (inst.op) {
+        case Inst::op_split:
+          stack.push_back(inst.out1);
+          stack.push_back(inst.out);
+          break;
+        case Inst::op_jump:
+        case Inst::op_assert:
+          stack.push_back(inst.out);
+          break;
+        case Inst::op_chars:
+          for (size_t cls = 0; cls != first_.size(); ++cls) {
+            if (accepts_[inst.arg][cls])
+              first_[cls] = true;
+          }
+          break;
+        case Inst::op_match:
+          break;
+      }
+    }
+  }
+};
+
+const int Regex::max_repeat;
+const size_t Regex::max_insts;
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::RegexMatcher
+// forward_ : the DFA of the regex, anchored where the match attempt starts.
+// reverse_ : the DFA of the reversed regex, see mark_starts().
+// can_start_ : for the line being searched, where a match starts.
+// trail_ : for the line being searched, the state of the forward DFA at each
+//          position the attempts went by, see longest().
+//
+// The DFA cache of a Regex. It is not thread safe, each thread needs its own.
+//
+class RegexMatcher {
+  static const size_t max_states = 4096;
+  static const int dead = 0;
+  enum Flags {
+    prev_word = 1,
+    at_line_start = 2
+  };
+
+  // kernels : for each state, the NFA states it was entered at, sorted, and last
+  //           its flags.
+  // table : for each state and class the next state times two, plus one if there
+  //         is a match before the unit. -1 if not computed yet.
+  // starts : the start state for each value of the flags.
+  struct Dfa {
+    const std::vector<Regex::Inst>* insts;
+    int start;
+    std::vector<std::vector<int>> kernels;
+    std::map<std::vector<int>, int> ids;
+    std::vector<int> table;
+    int starts[4];
+  };
+
+  const Regex& regex_;
+  std::unique_ptr<SubstringSearch> prefix_;
+  // the classes plus one for the end of the line.
+  size_t stride_;
+  Dfa forward_;
+  Dfa reverse_;
+  std::vector<int> stack_;
+  std::vector<bool> seen_;
+  std::vector<bool> can_start_;
+
+  // an entry is valid if it has the current |stamp_|.
+  struct Trail {
+    uint32_t stamp;
+    int state;
+    // the end of the last match at or after the position, or npos.
+    size_t last;
+  };
+  std::vector<Trail> trail_;
+  uint32_t stamp_;
+
+  RegexMatcher& operator=(const RegexMatcher&) = delete;
+  RegexMatcher(const RegexMatcher&) = delete;
+
+public:
+  static const size_t npos = static_cast<size_t>(-1);
+
+  explicit RegexMatcher(const Regex& regex)
+      : regex_(regex),
+        stride_(regex.class_count() + 1),
+        seen_(std::max(regex.insts_.size(), regex.reverse_insts_.size())),
+        stamp_(0) {
+    if (!regex_.prefix_.empty())
+      prefix_ = std::make_unique<SubstringSearch>(
+          plx::Range<const uint16_t>(reinterpret_cast<const uint16_t*>(regex_.prefix_.c_str()),
+                                     regex_.prefix_.size()));
+    forward_.insts = &regex_.insts_;
+    forward_.start = regex_.start_;
+    reset(&forward_);
+    reverse_.insts = &regex_.reverse_insts_;
+    reverse_.start = regex_.reverse_start_;
+    reset(&reverse_);
+  }
+
+  // calls |fn| with the (start, end) of the matches in |line|, which has no LFs.
+  // Attempts start where the prefilter says, but once the failed ones have read a
+  // few times the line, mark_starts() finds where matches start in one pass and
+  // only those are tried. That keeps a line from costing the square of its length.
+  template <typename Fn>
+  void for_each_match(const plx::Range<const uint16_t>& line, const Fn& fn) {
+    auto n = line.size();
+    new_stamp();
+    if (trail_.size() < n + 1) {
+      Trail trail = { 0, 0, 0 };
+      trail_.resize(n + 1, trail);
+    }
+    size_t wasted = 0;
+    bool marked = false;
+    for (size_t pos = 0; pos < n; ) {
+      auto at = pos;
+      if (marked) {
+        while ((at != n) && !can_start_[at])
+          ++at;
+        if (at == n)
+          return;
+      } else {
+        at = candidate(line, pos);
+        if (at == npos)
+          return;
+      }
+      size_t read = 0;
+      auto end = longest(line, at, &read);
+      if ((end == npos) || (end == at)) {
+        pos = at + 1;
+        wasted += read;
+        if (!marked && (wasted > 4 * n + 64)) {
+          mark_starts(line);
+          marked = true;
+        }
+        continue;
+      }
+      fn(at, end);
+      pos = end;
+    }
+  }
+
+private:
+  void new_stamp() {
+    if (++stamp_)
+      return;
+    for (auto& trail : trail_)
+      trail.stamp = 0;
+    stamp_ = 1;
+  }
+
+  void reset(Dfa* dfa) {
+    // the states get new numbers.
+    if (dfa == &forward_)
+      new_stamp();
+    dfa->kernels.clear();
+    dfa->ids.clear();
+    dfa->table.clear();
+    std::fill(std::begin(dfa->starts), std::end(dfa->starts), -1);
+    // the dead state has no NFA states.
+    intern(dfa, std::vector<int>(1, 0));
+  }
+
+  size_t candidate(const plx::Range<const uint16_t>& line, size_t pos) const {
+    if (prefix_)
+      return prefix_->find(line, pos);
+    auto s = line.start();
+    for (; pos != line.size(); ++pos) {
+      if (regex_.first_[regex_.class_of_[s[pos]]])
+        return pos;
+    }
+    return npos;
+  }
+
+  // the end of the longest match that starts at |pos| or npos. |read| gets how
+  // many units it looked at.
+  //
+  // The DFA goes the same way from a state and position, so when the attempt gets
+  // to the state an earlier attempt had at the same position it can stop: the rest
+  // is what the earlier one found. Without that, with "a|a.*z" every 'a' of a line
+  // with no 'z' would read to the end of the line.
+  size_t longest(const plx::Range<const uint16_t>& line, size_t pos, size_t* read) {
+    auto s = line.start();
+    auto n = line.size();
+    int flags = pos ? (Regex::is_word(s[pos - 1]) ? prev_word : 0) : at_line_start;
+    auto state = start(&forward_, flags);
+    auto last = npos;
+    auto ix = pos;
+    size_t known;
+    for (; ; ++ix) {
+      auto& trail = trail_[ix];
+      if ((trail.stamp == stamp_) && (trail.state == state)) {
+        if (trail.last != npos)
+          last = trail.last;
+        known = ix;
+        break;
+      }
+      trail.stamp = stamp_;
+      trail.state = state;
+      auto next = step(&forward_, state, (ix != n) ? regex_.class_of_[s[ix]] : stride_ - 1);
+      if (next & 1)
+        last = ix;
+      state = next >> 1;
+      if ((ix == n) || (state == dead)) {
+        known = ix + 1;
+        break;
+      }
+    }
+    // if the cache was flushed on the way the stamp changed and these are ignored.
+    for (auto it = pos; it != known; ++it)
+      trail_[it].last = ((last != npos) && (last >= it)) ? last : npos;
+    *read = ix - pos + 1;
+    return last;
+  }
+
+  // the reverse DFA reads the line from the end and can start at any unit, so
+  // it has a match at each position where a match of the regex starts.
+  void mark_starts(const plx::Range<const uint16_t>& line) {
+    auto s = line.start();
+    auto n = line.size();
+    can_start_.assign(n + 1, false);
+    // for it the end of the line is the start, and the unit before is on the right.
+    auto state = start(&reverse_, at_line_start);
+    for (auto ix = n; ; --ix) {
+      auto next = step(&reverse_, state, ix ? regex_.class_of_[s[ix - 1]] : stride_ - 1);
+      if (next & 1)
+        can_start_[ix] = true;
+      if (!ix)
+        return;
+      state = next >> 1;
+    }
+  }
+
+  int start(Dfa* dfa, int flags) {
+    if (dfa->starts[flags] < 0) {
+      std::vector<int> kernel(1, dfa->start);
+      kernel.push_back(flags);
+      // interning can flush the cache, which clears |starts|.
+      auto state = intern(dfa, kernel);
+      dfa->starts[flags] = state;
+    }
+    return dfa->starts[flags];
+  }
+
+  int step(Dfa* dfa, int state, size_t cls) {
+    auto next = dfa->table[state * stride_ + cls];
+    return (next < 0) ? transition(dfa, state, cls) : next;
+  }
+
+  int intern(Dfa* dfa, const std::vector<int>& kernel) {
+    auto it = dfa->ids.find(kernel);
+    if (it != dfa->ids.end())
+      return it->second;
+    if (dfa->kernels.size() == max_states) {
+      auto copy = kernel;
+      reset(dfa);
+      return intern(dfa, copy);
+    }
+    auto state = static_cast<int>(dfa->kernels.size());
+    dfa->kernels.push_back(kernel);
+    dfa->ids.insert(std::make_pair(kernel, state));
+    dfa->table.resize(dfa->table.size() + stride_, -1);
+    return state;
+  }
+
+  bool holds(int assertion, int flags, bool next_word, bool at_end) const {
+    switch (assertion) {
+      case Regex::line_start: return (flags & at_line_start) != 0;
+      case Regex::line_end: return at_end;
+      case Regex::word_boundary: return ((flags & prev_word) != 0) != next_word;
+      case Regex::not_word_boundary: return ((flags & prev_word) != 0) == next_word;
+    }
+    return false;
+  }
+
+  // follows the NFA from the states of |state| over the class |cls|, the last class
+  // being the end of the line. The assertions are checked against the units before
+  // and after, so whether there is a match also depends on |cls|.
+  int transition(Dfa* dfa, int state, size_t cls) {
+    auto kernel = dfa->kernels[state];
+    auto flags = kernel.back();
+    kernel.pop_back();
+    bool at_end = (cls == stride_ - 1);
+    bool next_word = !at_end && regex_.class_word_[cls];
+
+    std::vector<int> next;
+    bool match = false;
+    std::fill(seen_.begin(), seen_.end(), false);
+    stack_.assign(kernel.begin(), kernel.end());
+    while (!stack_.empty()) {
+      auto pc = stack_.back();
+      stack_.pop_back();
+      if (seen_[pc])
+        continue;
+      seen_[pc] = true;
+      const auto& inst = (*dfa->insts)[pc];
+      switch (inst.op) {
+        case Regex::Inst::op_split:
+          stack_.push_back(inst.out1);
+          stack_.push_back(inst.out);
+          break;
+        case Regex::Inst::op_jump:
+          stack_.push_back(inst.out);
+          break;
+        case Regex::Inst::op_assert:
+          if (holds(inst.arg, flags, next_word, at_end))
+            stack_.push_back(inst.out);
+          break;
+        case Regex::Inst::op_chars:
+          if (!at_end && regex_.accepts_[inst.arg][cls])
+            next.push_back(inst.out);
+          break;
+        case Regex::Inst::op_match:
+          match = true;
+          break;
+      }
+    }
+
+    int target = dead;
+    if (!next.empty()) {
+      std::sort(next.begin(), next.end());
+      next.erase(std::unique(next.begin(), next.end()), next.end());
+      next.push_back(next_word ? prev_word : 0);
+      auto size = dfa->kernels.size();
+      target = intern(dfa, next);
+      if (dfa->kernels.size() < size) {
+        // the cache was flushed, |state| is gone.
+        return (target << 1) | (match ? 1 : 0);
+      }
+    }
+    auto value = (target << 1) | (match ? 1 : 0);
+    dfa->table[state * stride_ + cls] = value;
+    return value;
+  }
+};
+
+const size_t RegexMatcher::max_states;
+const int RegexMatcher::dead;
+const size_t RegexMatcher::npos;
+
+}  // namespace plx
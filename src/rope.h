@@ -0,0 +1,376 @@
+// TExTO.  Copyright 2014, Carlos Pizano (carlos.pizano@gmail.com)
+// TExTO is a text editor prototype. This is the rope, the alternative to
+// the piece table for storing the document.
+
+#pragma once
+#include "stdafx.h"
+#include "text_store.h"
+
+// The rope is a B-tree of text chunks. Leaves hold up to |leaf_max| characters and
+// every node caches how many characters and how many LFs are below it, so finding
+// an offset or the start of a line just descends the tree. All the leaves are at
+// the same depth and nodes have at most |node_max| children which makes inserts,
+// erases and lookups O(log n).
+//
+// Nodes are shared copy-on-write with the versions returned by snapshot(). An edit
+// copies the path from the root to the leaves it touches if those nodes are shared,
+// so a version costs a pointer and what the edits after it changed.
+class Rope : public TextStore {
+  static const size_t leaf_max = 2048;
+  static const size_t node_max = 16;
+
+  struct Node {
+    const bool leaf;
+    // characters and LFs in this subtree.
+    size_t length;
+    size_t newlines;
+    // internal nodes have |children|, leaves have |text|.
+    std::vector<std::shared_ptr<Node>> children;
+    std::wstring text;
+
+    explicit Node(bool leaf) : leaf(leaf), length(0), newlines(0) {}
+
+    void update() {
+      if (leaf) {
+        length = text.size();
+        newlines = std::count(text.begin(), text.end(), L'\n');
+        return;
+      }
+      length = 0;
+      newlines = 0;
+      for (const auto& child : children) {
+        length += child->length;
+        newlines += child->newlines;
+      }
+    }
+  };
+
+  typedef std::vector<std::shared_ptr<Node>> NodeList;
+
+  class Snapshot : public TextSource {
+    friend class Rope;
+    const std::shared_ptr<Node> root_;
+
+  public:
+    explicit Snapshot(std::shared_ptr<Node> root) : root_(root) {}
+
+    size_t size() const override { return root_->length; }
+
+    void for_each_chunk(size_t from, size_t to, const ChunkFn& fn) const override {
+      to = std::min(to, root_->length);
+      if (from >= to)
+        return;
+      chunks_node(root_.get(), 0, from, to, fn);
+    }
+  };
+
+  std::shared_ptr<Node> root_;
+
+  Rope& operator=(const Rope&) = delete;
+  Rope(const Rope&) = delete;
+
+public:
+  explicit Rope(std::unique_ptr<std::wstring> text) {
+    // build the tree bottom up, with full leaves.
+    NodeList level;
+    if (text) {
+      for (size_t pos = 0; pos < text->size(); pos += leaf_max) {
+        auto count = std::min(leaf_max, text->size() - pos);
+        level.push_back(make_leaf(&(*text)[pos], count));
+      }
+    }
+    if (level.empty())
+      level.push_back(make_leaf(nullptr, 0));
+
+    while (level.size() > 1) {
+      auto parent = std::make_shared<Node>(false);
+      parent->children.swap(level);
+      level = split_node(parent.get());
+      level.insert(level.begin(), std::move(parent));
+    }
+    root_ = std::move(level.front());
+  }
+
+  size_t size() const override { return root_->length; }
+
+  wchar_t char_at(size_t pos) const override {
+    if (pos >= root_->length)
+      throw plx::RangeException(__LINE__, nullptr);
+    const Node* node = root_.get();
+    while (!node->leaf)
+      node = node->children[child_at(node, &pos)].get();
+    return node->text[pos];
+  }
+
+  void insert(size_t pos, const wchar_t* text, size_t count) override {
+    if (pos > root_->length)
+      throw plx::RangeException(__LINE__, nullptr);
+    if (!count)
+      return;
+
+    auto extra = insert_node(root_, pos, text, count);
+    while (!extra.empty()) {
+      // the root split, the tree grows one level.
+      auto root = std::make_shared<Node>(false);
+      root->children.push_back(std::move(root_));
+      for (auto& node : extra)
+        root->children.push_back(std::move(node));
+      extra = split_node(root.get());
+      root_ = std::move(root);
+    }
+  }
+
+  void erase(size_t pos, size_t count) override {
+    if (pos + count > root_->length)
+      throw plx::RangeException(__LINE__, nullptr);
+    if (!count)
+      return;
+
+    erase_node(root_, pos, count);
+    // the tree shrinks when the root has a single child.
+    while (!root_->leaf && (root_->children.size() == 1)) {
+      auto child = root_->children.front();
+      root_ = child;
+    }
+    if (!root_->leaf && root_->children.empty())
+      root_ = make_leaf(nullptr, 0);
+  }
+
+  void for_each_chunk(size_t from, size_t to, const ChunkFn& fn) const override {
+    to = std::min(to, root_->length);
+    if (from >= to)
+      return;
+    chunks_node(root_.get(), 0, from, to, fn);
+  }
+
+  size_t line_count() const override {
+    return root_->newlines + 1;
+  }
+
+  size_t offset_of_line(size_t line) const override {
+    if (!line)
+      return 0;
+    if (line > root_->newlines)
+      return root_->length;
+    // look for the |line|th LF, the line starts right after it.
+    size_t offset = 0;
+    const Node* node = root_.get();
+    while (!node->leaf) {
+      for (const auto& child : node->children) {
+        if (line <= child->newlines) {
+          node = child.get();
+          break;
+        }
+        line -= child->newlines;
+        offset += child->length;
+      }
+    }
+    for (size_t ix = 0; ix != node->text.size(); ++ix) {
+      if ((node->text[ix] == L'\n') && (--line == 0))
+        return offset + ix + 1;
+    }
+    __debugbreak();
+    return root_->length;
+  }
+
+  size_t line_of_offset(size_t pos) const override {
+    if (pos >= root_->length)
+      return root_->newlines;
+    size_t line = 0;
+    const Node* node = root_.get();
+    while (!node->leaf) {
+      for (const auto& child : node->children) {
+        if (pos < child->length) {
+          node = child.get();
+          break;
+        }
+        line += child->newlines;
+        pos -= child->length;
+      }
+    }
+    return line + std::count(node->text.begin(), node->text.begin() + pos, L'\n');
+  }
+
+  std::shared_ptr<const TextSource> snapshot() const override {
+    return std::make_shared<Snapshot>(root_);
+  }
+
+  void restore(const TextSource& version, size_t, size_t) override {
+    auto snap = dynamic_cast<const Snapshot*>(&version);
+    if (!snap)
+      throw plx::InvalidParamException(__LINE__, 1);
+    // the counts are in the nodes, there is nothing else to fix.
+    root_ = snap->root_;
+  }
+
+private:
+  static std::shared_ptr<Node> make_leaf(const wchar_t* text, size_t count) {
+    auto leaf = std::make_shared<Node>(true);
+    if (count)
+      leaf->text.assign(text, count);
+    leaf->update();
+    return leaf;
+  }
+
+  // returns the node in |slot| after making sure no version shares it.
+  static Node* writable(std::shared_ptr<Node>& slot) {
+    if (slot.use_count() > 1)
+      slot = std::make_shared<Node>(*slot);
+    return slot.get();
+  }
+
+  // returns the index of the child that has |pos| and makes |pos| relative to it.
+  static size_t child_at(const Node* node, size_t* pos) {
+    size_t ix = 0;
+    for (; ix != node->children.size() - 1; ++ix) {
+      if (*pos < node->children[ix]->length)
+        break;
+      *pos -= node->children[ix]->length;
+    }
+    return ix;
+  }
+
+  // if |leaf| has too much text it keeps the first part and the rest is returned
+  // as new leaves of about the same size.
+  static NodeList split_leaf(Node* leaf) {
+    NodeList extra;
+    auto size = leaf->text.size();
+    if (size > leaf_max) {
+      auto parts = (size + leaf_max - 1) / leaf_max;
+      auto part_len = size / parts;
+      auto pos = part_len;
+      for (size_t ix = 1; ix != parts; ++ix) {
+        auto count = (ix == parts - 1) ? size - pos : part_len;
+        extra.push_back(make_leaf(&leaf->text[pos], count));
+        pos += count;
+      }
+      leaf->text.resize(part_len);
+    }
+    leaf->update();
+    return extra;
+  }
+
+  // same as split_leaf() but for internal nodes with too many children.
+  static NodeList split_node(Node* node) {
+    NodeList extra;
+    auto size = node->children.size();
+    if (size > node_max) {
+      auto parts = (size + node_max - 1) / node_max;
+      auto part_len = size / parts;
+      auto it = node->children.begin() + part_len;
+      for (size_t ix = 1; ix != parts; ++ix) {
+        auto end = (ix == parts - 1) ? node->children.end() : it + part_len;
+        auto sibling = std::make_shared<Node>(false);
+        sibling->children.assign(std::make_move_iterator(it), std::make_move_iterator(end));
+        sibling->update();
+        extra.push_back(std::move(sibling));
+        it = end;
+      }
+      node->children.resize(part_len);
+    }
+    node->update();
+    return extra;
+  }
+
+  // returns the siblings that need to be placed after |node| if it had to split.
+  static NodeList insert_node(std::shared_ptr<Node>& slot, size_t pos,
+                              const wchar_t* text, size_t count) {
+    auto node = writable(slot);
+    if (node->leaf) {
+      node->text.insert(pos, text, count);
+      return split_leaf(node);
+    }
+    // prefer appending to a child over prepending to the next one.
+    size_t ix = 0;
+    for (; ix != node->children.size() - 1; ++ix) {
+      if (pos <= node->children[ix]->length)
+        break;
+      pos -= node->children[ix]->length;
+    }
+    auto extra = insert_node(node->children[ix], pos, text, count);
+    node->children.insert(node->children.begin() + ix + 1,
+                          std::make_move_iterator(extra.begin()),
+                          std::make_move_iterator(extra.end()));
+    return split_node(node);
+  }
+
+  static void erase_node(std::shared_ptr<Node>& slot, size_t pos, size_t count) {
+    auto node = writable(slot);
+    if (node->leaf) {
+      node->text.erase(pos, count);
+      node->update();
+      return;
+    }
+    size_t ix = 0;
+    while (count && (ix != node->children.size())) {
+      auto child = node->children[ix].get();
+      if (pos >= child->length) {
+        pos -= child->length;
+        ++ix;
+        continue;
+      }
+      auto n = std::min(count, child->length - pos);
+      if (n == child->length) {
+        node->children.erase(node->children.begin() + ix);
+      } else {
+        erase_node(node->children[ix], pos, n);
+        ++ix;
+      }
+      count -= n;
+      pos = 0;
+    }
+    merge_children(node);
+    node->update();
+  }
+
+  // joins neighbors that fit in a single node so the tree does not degrade after
+  // many erases. |node| must be writable, the right neighbor is only read because
+  // a version might share it.
+  static void merge_children(Node* node) {
+    auto& children = node->children;
+    for (size_t ix = 1; ix < children.size();) {
+      const Node* right = children[ix].get();
+      if (children[ix - 1]->leaf) {
+        if (children[ix - 1]->text.size() + right->text.size() > leaf_max) {
+          ++ix;
+          continue;
+        }
+        writable(children[ix - 1])->text.append(right->text);
+      } else {
+        if (children[ix - 1]->children.size() + right->children.size() > node_max) {
+          ++ix;
+          continue;
+        }
+        auto& grandchildren = writable(children[ix - 1])->children;
+        grandchildren.insert(grandchildren.end(), right->children.begin(), right->children.end());
+      }
+      children[ix - 1]->update();
+      children.erase(children.begin() + ix);
+    }
+  }
+
+  static bool chunks_node(const Node* node, size_t offset,
+                          size_t from, size_t to, const ChunkFn& fn) {
+    if (node->leaf) {
+      auto start = std::max(from, offset);
+      auto end = std::min(to, offset + node->length);
+      if (start >= end)
+        return true;
+      return fn(start, &node->text[start - offset], end - start);
+    }
+    for (const auto& child : node->children) {
+      if (offset >= to)
+        break;
+      if (offset + child->length > from) {
+        if (!chunks_node(child.get(), offset, from, to, fn))
+          return false;
+      }
+      offset += child->length;
+    }
+    return true;
+  }
+
+};
+
+const size_t Rope::leaf_max;
+const size_t Rope::node_max;
@@ -882,13 +882,39 @@ public:
     return li.QuadPart;
   }
 
-  size_t read(plx::Range<uint8_t>& mem, unsigned int from = -1) {
+  // in 100ns units since 1601, like FILETIME.
+  long long last_write_time() const {
+    FILETIME ft = {0};
+    ::GetFileTime(handle_, nullptr, nullptr, &ft);
+    LARGE_INTEGER li;
+    li.LowPart = ft.dwLowDateTime;
+    li.HighPart = ft.dwHighDateTime;
+    return li.QuadPart;
+  }
+
+  // makes sure that what was written is on the disk.
+  bool flush() {
+    return ::FlushFileBuffers(handle_) ? true : false;
+  }
+
+  // truncates or extends the file to |size| bytes and moves the current position
+  // there.
+  bool set_size(long long size) {
+    LARGE_INTEGER li;
+    li.QuadPart = size;
+    if (!::SetFilePointerEx(handle_, li, nullptr, FILE_BEGIN))
+      return false;
+    return ::SetEndOfFile(handle_) ? true : false;
+  }
+
+  // |from| is the byte offset in the file, or -1 for the current position.
+  size_t read(plx::Range<uint8_t>& mem, long long from = -1) {
     return read(mem.start(), mem.size(), from);
   }
 
-  size_t read(uint8_t* buf, size_t len, int from) {
+  size_t read(uint8_t* buf, size_t len, long long from) {
     OVERLAPPED ov = {0};
-    ov.Offset = from;
+    set_offset(&ov, from);
     DWORD read = 0;
     if (!::ReadFile(handle_, buf, static_cast<DWORD>(len),
                     &read, (from < 0) ? nullptr : &ov))
@@ -896,19 +922,59 @@ public:
     return read;
   }
 
-  size_t write(const plx::Range<const uint8_t>& mem, int from = -1) {
+  // scatter read, fills each of |mems| in order. Stops at the first short read.
+  size_t read(const std::vector<plx::Range<uint8_t>>& mems, long long from = -1) {
+    size_t total = 0;
+    for (const auto& mem : mems) {
+      auto count = read(mem.start(), mem.size(), from);
+      total += count;
+      if (count != mem.size())
+        break;
+      if (from >= 0)
+        from += count;
+    }
+    return total;
+  }
+
+  size_t write(const plx::Range<const uint8_t>& mem, long long from = -1) {
     return write(mem.start(), mem.size(), from);
   }
 
-  size_t write(const uint8_t* buf, size_t len, int from) {
+  size_t write(const uint8_t* buf, size_t len, long long from) {
     OVERLAPPED ov = {0};
-    ov.Offset = from;
+    set_offset(&ov, from);
     DWORD written = 0;
     if (!::WriteFile(handle_, buf, static_cast<DWORD>(len),
                      &written, (from < 0) ? nullptr : &ov))
       return 0;
     return written;
   }
+
+  // gather write, writes each of |mems| in order. Stops at the first short write.
+  // WriteFileGather() needs unbuffered io and page sized buffers so it is just a
+  // loop of WriteFile().
+  size_t write(const std::vector<plx::Range<const uint8_t>>& mems, long long from = -1) {
+    size_t total = 0;
+    for (const auto& mem : mems) {
+      auto count = write(mem.start(), mem.size(), from);
+      total += count;
+      if (count != mem.size())
+        break;
+      if (from >= 0)
+        from += count;
+    }
+    return total;
+  }
+
+private:
+  static void set_offset(OVERLAPPED* ov, long long from) {
+    if (from < 0)
+      return;
+    LARGE_INTEGER li;
+    li.QuadPart = from;
+    ov->Offset = li.LowPart;
+    ov->OffsetHigh = li.HighPart;
+  }
 };
 
 
@@ -0,0 +1,487 @@
+// TExTO.  Copyright 2014, Carlos Pizano (carlos.pizano@gmail.com)
+// TExTO is a text editor prototype. This is the find engine, it keeps the
+// matches of the last query.
+
+#pragma once
+#include "stdafx.h"
+#include "find_ranges.h"
+#include "folded_text.h"
+#include "fuzzy_search.h"
+#include "regex.h"
+#include "text_store.h"
+#include "text_search.h"
+#include "word_index.h"
+#include "worker_pool.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+// The user types the query one character at a time, so most queries extend the
+// previous one. The matches of the longer query are the matches of the previous
+// one that go on with the new characters, which is checked at each of them instead
+// of searching the whole text again. Anything else, or too many matches to check
+// one by one, is a full search.
+//
+// A full search runs in a thread over a snapshot of the text and never blocks the
+// window. It goes first over the part of the text in view, so the matches on screen
+// show right away, and then over the rest. The text is searched in segments, in
+// parallel with the pool, that overlap the next one by the query length minus one
+// so the matches across the boundary are found. Each segment keeps the matches that
+// start in it and hands them over as soon as it is done, then the window is told
+// with |message_| to call take_results(), which merges them in order. A new query or
+// clear() cancels the search in progress.
+//
+// Edits keep the matches, replaced() moves them and looks again only around the
+// edit, so typing with find on costs the query length plus the matches nearby.
+//
+// In folded mode the literal search runs over the text seen through a FoldedText,
+// without case or accents, with the query folded the same way. Each task folds
+// the segment it searches.
+//
+// In regex mode the query is a plx::Regex. Its matches don't span lines, so the
+// segments end at line starts instead of overlapping and after an edit the lines it
+// touched are searched again. There is no refinement, a longer pattern can match
+// more than a shorter one.
+//
+// Fuzzy mode finds the text that is a few edits away from the query with a
+// plx::FuzzySearch, line by line like regex mode.
+class TextFinder {
+public:
+  enum Mode {
+    literal,
+    folded,
+    regex,
+    fuzzy
+  };
+
+private:
+  Mode mode_;
+  // the query that |ranges_| has the matches of, folded in folded mode.
+  std::wstring query_;
+  Ranges ranges_;
+  // in folded mode, what folds the query and the text that is searched.
+  FoldedText folded_;
+  // true if |ranges_| came from set_words(), the matches are only whole words.
+  bool whole_words_;
+  // in regex mode, the compiled |query_| and the matcher that the edits use.
+  std::shared_ptr<const plx::Regex> regex_;
+  std::unique_ptr<plx::RegexMatcher> matcher_;
+  // in fuzzy mode, the search for |query_|.
+  std::shared_ptr<const plx::FuzzySearch> fuzzy_;
+  // true once |ranges_| has all the matches of |query_|.
+  bool complete_;
+  WorkerPool pool_;
+  // who gets told of new matches. Without a window the search is synchronous.
+  HWND window_;
+  UINT message_;
+  // the search in progress and what it found that take_results() has not taken.
+  std::thread thread_;
+  std::atomic<bool> cancel_;
+  std::mutex lock_;
+  std::vector<std::vector<Ranges::Tup>> incoming_;
+  bool done_;
+  bool posted_;
+
+  TextFinder& operator=(const TextFinder&) = delete;
+  TextFinder(const TextFinder&) = delete;
+
+public:
+  // more matches than this and checking each is slower than searching.
+  static const size_t refine_max = 64 * 1024;
+  static const size_t segment_size = 256 * 1024;
+  // fuzzy find allows an edit every this many characters of the query.
+  static const size_t fuzzy_ratio = 4;
+
+  TextFinder()
+      : mode_(literal),
+        whole_words_(false),
+        complete_(true),
+        pool_(WorkerPool::default_size(8)),
+        window_(nullptr), message_(0),
+        cancel_(false), done_(false), posted_(false) {
+  }
+
+  ~TextFinder() {
+    cancel();
+  }
+
+  void set_notify(HWND window, UINT message) {
+    window_ = window;
+    message_ = message;
+  }
+
+  const Ranges& ranges() const { return ranges_; }
+  Mode mode() const { return mode_; }
+
+  // the matches go, the next find() is in |mode|.
+  void set_mode(Mode mode) {
+    clear();
+    mode_ = mode;
+  }
+
+  void clear() {
+    cancel();
+    query_.clear();
+    ranges_.clear();
+    regex_.reset();
+    matcher_.reset();
+    fuzzy_.reset();
+    whole_words_ = false;
+    complete_ = true;
+  }
+
+  // the matches of |word| are |starts|, the places where it is a whole word, which
+  // come from a WordIndex. Edits keep them whole words.
+  void set_words(const std::wstring& word, const std::vector<size_t>& starts) {
+    clear();
+    query_ = word;
+    whole_words_ = true;
+    ranges_.reset(word.size());
+    for (auto start : starts)
+      ranges_.add(start, start + word.size());
+  }
+
+  // finds every occurrence of |query|, overlapping ones included. In regex and
+  // fuzzy modes the matches don't overlap and in regex mode a pattern that is not
+  // valid matches nothing. [view_from, view_to) is searched first.
+  void find(std::shared_ptr<const TextSource> text, const std::wstring& query,
+            size_t view_from, size_t view_to) {
+    if (mode_ != folded) {
+      start_find(text, query, view_from, view_to);
+      return;
+    }
+    start_find(folded_.view(text), folded_.fold(query), view_from, view_to);
+  }
+
+  // [pos, pos + erased) of |doc| became |inserted| characters. The matches move
+  // with the text and only the ones that could have changed, those that touch the
+  // edit, or its lines in regex and fuzzy modes, are looked for again. A search in progress is
+  // over the old text so it starts again.
+  void replaced(const TextStore& doc, size_t pos, size_t erased, size_t inserted,
+                size_t view_from, size_t view_to) {
+    if (query_.empty())
+      return;
+    if (!complete_) {
+      auto query = query_;
+      clear();
+      find(doc.snapshot(), query, view_from, view_to);
+      return;
+    }
+    std::vector<Ranges::Tup> found;
+    if (by_lines()) {
+      if (!matcher_ && !fuzzy_)
+        return;
+      // from the start of the line of |pos| to the end of the line of the last
+      // inserted character.
+      auto from = doc.line_start(pos);
+      auto last = doc.line_of_offset(pos + inserted);
+      auto to = (last + 1 < doc.line_count()) ? doc.offset_of_line(last + 1) - 1 : doc.size();
+      if (matcher_)
+        scan_lines(doc, matcher_.get(), from, to, &found);
+      else
+        scan_lines(doc, fuzzy_.get(), from, to, &found);
+      ranges_.replace(from, to - inserted + erased, erased, inserted, found);
+      return;
+    }
+    std::unique_ptr<const TextSource> shadow;
+    if (mode_ == folded)
+      shadow = folded_.view(doc);
+    auto& text = shadow ? *shadow : doc;
+    // whole words also change when the edit is right before or after them.
+    size_t touch = whole_words_ ? 1 : 0;
+    auto reach = query_.size() - 1 + touch;
+    auto from = (pos >= reach) ? pos - reach : 0;
+    auto to = std::min(pos + inserted + reach, text.size());
+    plx::SubstringSearch search(plx::RangeFromString(query_));
+    scan(text, search, from, to, pos + inserted + touch, &found);
+    if (whole_words_) {
+      found.erase(std::remove_if(found.begin(), found.end(), [&doc](const Ranges::Tup& f) {
+        return !is_whole_word(doc, std::get<0>(f), std::get<1>(f));
+      }), found.end());
+    }
+    ranges_.replace(from, pos + erased + touch, erased, inserted, found);
+  }
+
+  // merges the matches found since the last call. Returns true if there were any.
+  bool take_results() {
+    std::vector<std::vector<Ranges::Tup>> incoming;
+    bool done;
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      incoming.swap(incoming_);
+      done = done_;
+      posted_ = false;
+    }
+    if (done) {
+      if (thread_.joinable())
+        thread_.join();
+      complete_ = true;
+    }
+    if (incoming.empty())
+      return false;
+    // each segment is sorted but they come in any order.
+    std::vector<Ranges::Tup> found;
+    for (const auto& segment : incoming)
+      found.insert(found.end(), segment.begin(), segment.end());
+    std::sort(found.begin(), found.end());
+    ranges_.merge(found);
+    return true;
+  }
+
+private:
+  // what the segment tasks search with, one of them is set.
+  struct Searcher {
+    std::shared_ptr<const plx::SubstringSearch> literal;
+    std::shared_ptr<const plx::Regex> regex;
+    std::shared_ptr<const plx::FuzzySearch> fuzzy;
+  };
+
+  // regex and fuzzy matches don't span lines.
+  bool by_lines() const {
+    return (mode_ == regex) || (mode_ == fuzzy);
+  }
+
+  // |text| and |query| are already folded in folded mode.
+  void start_find(std::shared_ptr<const TextSource> text, const std::wstring& query,
+                  size_t view_from, size_t view_to) {
+    auto refine = !by_lines() && !whole_words_ &&
+                  complete_ && !query_.empty() && (query.size() > query_.size()) &&
+                  !query.compare(0, query_.size(), query_) &&
+                  (ranges_.size() <= refine_max);
+    cancel();
+    auto known = query_.size();
+    query_ = query;
+    if (refine) {
+      ranges_.filter([&](size_t start) {
+        return continues_at(*text, start + known, known);
+      }, query_.size());
+      return;
+    }
+    whole_words_ = false;
+    ranges_.reset(by_lines() ? 0 : query_.size());
+    regex_.reset();
+    matcher_.reset();
+    fuzzy_.reset();
+    complete_ = query_.empty();
+    if (complete_)
+      return;
+
+    Searcher searcher;
+    if (mode_ == regex) {
+      try {
+        regex_ = std::make_shared<plx::Regex>(query_);
+      } catch (plx::RegexException&) {
+        complete_ = true;
+        return;
+      }
+      matcher_ = std::make_unique<plx::RegexMatcher>(*regex_);
+      searcher.regex = regex_;
+    } else if (mode_ == fuzzy) {
+      fuzzy_ = std::make_shared<plx::FuzzySearch>(
+          plx::RangeFromString(query_), query_.size() / fuzzy_ratio);
+      searcher.fuzzy = fuzzy_;
+    } else {
+      searcher.literal = std::make_shared<plx::SubstringSearch>(plx::RangeFromString(query_));
+    }
+
+    if (!window_) {
+      search_all(*text, searcher, view_from, view_to);
+      take_results();
+      return;
+    }
+    thread_ = std::thread([this, text, searcher, view_from, view_to]() {
+      search_all(*text, searcher, view_from, view_to);
+    });
+  }
+
+  void cancel() {
+    cancel_ = true;
+    if (thread_.joinable())
+      thread_.join();
+    cancel_ = false;
+    std::lock_guard<std::mutex> lock(lock_);
+    incoming_.clear();
+    done_ = false;
+  }
+
+  static bool is_whole_word(const TextStore& doc, size_t start, size_t end) {
+    return ((start == 0) || !WordIndex::is_word_unit(doc.char_at(start - 1))) &&
+           ((end == doc.size()) || !WordIndex::is_word_unit(doc.char_at(end)));
+  }
+
+  // true if the text at |pos| is the query from |known| on.
+  bool continues_at(const TextSource& text, size_t pos, size_t known) const {
+    auto count = query_.size() - known;
+    if (pos + count > text.size())
+      return false;
+    auto expected = query_.c_str() + known;
+    bool equal = true;
+    text.for_each_chunk(pos, pos + count, [&](size_t offset, const wchar_t* chunk, size_t len) {
+      equal = std::equal(chunk, chunk + len, expected + (offset - pos));
+      return equal;
+    });
+    return equal;
+  }
+
+  // the first line start at or after |pos|, or the size of the text.
+  static size_t next_line(const TextSource& text, size_t pos) {
+    if (!pos)
+      return 0;
+    auto next = text.size();
+    text.for_each_chunk(pos - 1, next, [&next](size_t offset, const wchar_t* chunk, size_t len) {
+      auto lf = std::find(chunk, chunk + len, L'\n');
+      if (lf == chunk + len)
+        return true;
+      next = offset + (lf - chunk) + 1;
+      return false;
+    });
+    return next;
+  }
+
+  // the view starts at a line start and when the search is by lines it is made
+  // to end at one.
+  void search_all(const TextSource& text, const Searcher& searcher,
+                  size_t view_from, size_t view_to) {
+    auto size = text.size();
+    view_to = std::min(view_to, size);
+    view_from = std::min(view_from, view_to);
+    if (!searcher.literal)
+      view_to = next_line(text, view_to);
+    search_span(text, searcher, view_from, view_to);
+    search_span(text, searcher, view_to, size);
+    search_span(text, searcher, 0, view_from);
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      done_ = true;
+    }
+    notify();
+  }
+
+  // searches [from, to) one segment per task. When the search is by lines each
+  // task moves the ends of its segment to the next line start, the same way for
+  // both sides of a boundary, so each line is searched by one task.
+  void search_span(const TextSource& text, const Searcher& searcher,
+                   size_t from, size_t to) {
+    auto size = text.size();
+    for (auto start = from; start < to; start += segment_size) {
+      auto end = std::min(start + segment_size, to);
+      pool_.post([this, &text, &searcher, start, end, size]() {
+        if (cancel_)
+          return;
+        std::vector<Ranges::Tup> found;
+        if (searcher.regex) {
+          plx::RegexMatcher matcher(*searcher.regex);
+          scan_lines(text, &matcher, next_line(text, start), next_line(text, end), &found);
+        } else if (searcher.fuzzy) {
+          scan_lines(text, searcher.fuzzy.get(), next_line(text, start), next_line(text, end),
+                     &found);
+        } else {
+          auto& search = *searcher.literal;
+          scan(text, search, start, std::min(end + search.size() - 1, size), end, &found);
+        }
+        if (found.empty() || cancel_)
+          return;
+        {
+          std::lock_guard<std::mutex> lock(lock_);
+          incoming_.push_back(std::move(found));
+        }
+        notify();
+      });
+    }
+    pool_.wait();
+  }
+
+  void notify() {
+    if (!window_)
+      return;
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      if (posted_)
+        return;
+      posted_ = true;
+    }
+    ::PostMessageW(window_, message_, 0, 0);
+  }
+
+  // adds to |out| the matches inside [from, to) that start before |limit|.
+  void scan(const TextSource& text, const plx::SubstringSearch& search,
+            size_t from, size_t to, size_t limit, std::vector<Ranges::Tup>* out) {
+    const auto npos = plx::SubstringSearch::npos;
+    const auto m = search.size();
+    auto add = [out, limit, m](size_t x) {
+      if (x < limit)
+        out->emplace_back(x, x + m);
+    };
+    // the text is searched one chunk at a time. |carry| has the last characters
+    // of the previous chunks so we can find the matches that straddle two chunks.
+    const size_t tail_len = m - 1;
+    std::wstring carry;
+    text.for_each_chunk(from, to,
+        [this, &search, npos, &add, &carry, tail_len](size_t offset, const wchar_t* chunk, size_t len) {
+      if (!carry.empty()) {
+        auto window = carry + std::wstring(chunk, std::min(len, tail_len));
+        auto window_start = offset - carry.size();
+        auto range = plx::RangeFromString(window);
+        for (auto x = search.find(range, 0); (x != npos) && (x < carry.size());
+             x = search.find(range, x + 1)) {
+          add(window_start + x);
+        }
+      }
+
+      plx::Range<const uint16_t> range(reinterpret_cast<const uint16_t*>(chunk), len);
+      for (auto x = search.find(range, 0); x != npos; x = search.find(range, x + 1))
+        add(offset + x);
+
+      auto end = chunk + len;
+      if (len >= tail_len) {
+        carry.assign(end - tail_len, tail_len);
+      } else {
+        carry.append(chunk, len);
+        carry.erase(0, carry.size() - std::min(carry.size(), tail_len));
+      }
+      return !cancel_;
+    });
+  }
+
+  // adds to |out| the matches of |matcher| in [from, to), which starts at a line
+  // start and ends at one or at the end of the text. A line that is all in one chunk
+  // is matched in place, one that spans chunks is put together in |line| first.
+  template <typename Matcher>
+  void scan_lines(const TextSource& text, Matcher* matcher,
+                  size_t from, size_t to, std::vector<Ranges::Tup>* out) {
+    auto match = [matcher, out](size_t line_start, const wchar_t* start, size_t len) {
+      plx::Range<const uint16_t> range(reinterpret_cast<const uint16_t*>(start), len);
+      matcher->for_each_match(range, [out, line_start](size_t s, size_t e) {
+        out->emplace_back(line_start + s, line_start + e);
+      });
+    };
+    std::wstring line;
+    size_t line_start = from;
+    text.for_each_chunk(from, to, [&](size_t offset, const wchar_t* chunk, size_t len) {
+      auto end = chunk + len;
+      for (auto it = chunk; it != end; ) {
+        auto lf = std::find(it, end, L'\n');
+        if (lf == end) {
+          line.append(it, end);
+          break;
+        }
+        if (line.empty()) {
+          match(line_start, it, lf - it);
+        } else {
+          line.append(it, lf);
+          match(line_start, line.c_str(), line.size());
+          line.clear();
+        }
+        it = lf + 1;
+        line_start = offset + (it - chunk);
+      }
+      return !cancel_;
+    });
+    if (!line.empty())
+      match(line_start, line.c_str(), line.size());
+  }
+};
+
+const size_t TextFinder::refine_max;
+const size_t TextFinder::segment_size;
+const size_t TextFinder::fuzzy_ratio;
@@ -0,0 +1,129 @@
+// TExTO.  Copyright 2014, Carlos Pizano (carlos.pizano@gmail.com)
+// TExTO is a text editor prototype. This is the substring search used by find.
+
+#pragma once
+#include "stdafx.h"
+#include "utf8_codec.h"
+
+// Short needles use the first and last unit filter: a vector compare of 8 or 16
+// positions at once against the first unit of the needle and, shifted by the needle
+// length, against the last one. Only the positions where both match are verified,
+// which for text is almost never a false hit. Long needles use Boyer-Moore-Horspool
+// which skips up to a needle length per step. The SSE2 and AVX2 detection is the
+// same as the transcoder's and the scalar code handles the rest.
+
+namespace plx {
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::SubstringSearch
+// needle_ : the UTF-16 units to find.
+// skip_ : the Horspool shift for each value of the low byte of a unit.
+//
+class SubstringSearch {
+  std::vector<uint16_t> needle_;
+  std::vector<size_t> skip_;
+
+public:
+  static const size_t npos = static_cast<size_t>(-1);
+  // needles this long or longer use Horspool.
+  static const size_t long_needle = 32;
+
+  explicit SubstringSearch(const plx::Range<const uint16_t>& needle)
+      : needle_(needle.start(), needle.end()) {
+    auto m = needle_.size();
+    if (m < long_needle)
+      return;
+    // units that share the low byte share the entry, so it has the smallest shift.
+    skip_.assign(256, m);
+    for (size_t ix = 0; ix != m - 1; ++ix)
+      skip_[needle_[ix] & 0xFF] = m - 1 - ix;
+  }
+
+  size_t size() const { return needle_.size(); }
+
+  // returns the offset in |text| of the first occurrence that starts at or after
+  // |from|, or npos. Finding the next one, overlapping or not, is up to the caller.
+  size_t find(const plx::Range<const uint16_t>& text, size_t from) const {
+    auto m = needle_.size();
+    if (!m || (text.size() < m) || (from > text.size() - m))
+      return npos;
+    return (m < long_needle) ? filter(text, from) : horspool(text, from);
+  }
+
+private:
+  // the first and last units of the needle are at |text| and |text| + m - 1.
+  bool verify(const uint16_t* text) const {
+    auto m = needle_.size();
+    return (m <= 2) || !memcmp(text + 1, &needle_[1], (m - 2) * sizeof(uint16_t));
+  }
+
+  size_t filter(const plx::Range<const uint16_t>& text, size_t from) const {
+    auto s = text.start();
+    auto n = text.size();
+    auto m = needle_.size();
+    auto first = needle_[0];
+    auto last = needle_[m - 1];
+    auto ix = from;
+#if defined(PLX_UTF8_AVX2)
+    {
+      auto vf = _mm256_set1_epi16(static_cast<short>(first));
+      auto vl = _mm256_set1_epi16(static_cast<short>(last));
+      for (; ix + m - 1 + 16 <= n; ix += 16) {
+        auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + ix));
+        auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + ix + m - 1));
+        auto eq = _mm256_and_si256(_mm256_cmpeq_epi16(a, vf), _mm256_cmpeq_epi16(b, vl));
+        // two bits per unit.
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(eq));
+        while (mask) {
+          auto bit = utf8_internal::TrailingZeros(mask);
+          if (verify(s + ix + bit / 2))
+            return ix + bit / 2;
+          mask &= ~(3U << bit);
+        }
+      }
+    }
+#endif
+#if defined(PLX_UTF8_SSE2)
+    {
+      auto vf = _mm_set1_epi16(static_cast<short>(first));
+      auto vl = _mm_set1_epi16(static_cast<short>(last));
+      for (; ix + m - 1 + 8 <= n; ix += 8) {
+        auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + ix));
+        auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + ix + m - 1));
+        auto eq = _mm_and_si128(_mm_cmpeq_epi16(a, vf), _mm_cmpeq_epi16(b, vl));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(eq));
+        while (mask) {
+          auto bit = utf8_internal::TrailingZeros(mask);
+          if (verify(s + ix + bit / 2))
+            return ix + bit / 2;
+          mask &= ~(3U << bit);
+        }
+      }
+    }
+#endif
+    for (; ix + m <= n; ++ix) {
+      if ((s[ix] == first) && (s[ix + m - 1] == last) && verify(s + ix))
+        return ix;
+    }
+    return npos;
+  }
+
+  size_t horspool(const plx::Range<const uint16_t>& text, size_t from) const {
+    auto s = text.start();
+    auto n = text.size();
+    auto m = needle_.size();
+    auto last = needle_[m - 1];
+    for (auto ix = from; ix + m <= n; ) {
+      auto c = s[ix + m - 1];
+      if ((c == last) && !memcmp(s + ix, &needle_[0], (m - 1) * sizeof(uint16_t)))
+        return ix;
+      ix += skip_[c & 0xFF];
+    }
+    return npos;
+  }
+};
+
+const size_t SubstringSearch::npos;
+const size_t SubstringSearch::long_needle;
+
+}  // namespace plx
@@ -0,0 +1,77 @@
+// TExTO.  Copyright 2014, Carlos Pizano (carlos.pizano@gmail.com)
+// TExTO is a text editor prototype. This is the interface of the document
+// storage engines.
+
+#pragma once
+#include "stdafx.h"
+#include <functional>
+
+enum class TextStoreKind {
+  piece_table,    // see piece_table.h.
+  rope            // see rope.h.
+};
+
+// Text that can be read one contiguous span at a time. Offsets are in UTF-16 units.
+class TextSource {
+public:
+  // receives (offset, text, length) for each contiguous span of the text,
+  // return false to stop the iteration.
+  typedef std::function<bool (size_t, const wchar_t*, size_t)> ChunkFn;
+
+  virtual ~TextSource() {}
+
+  virtual size_t size() const = 0;
+  virtual void for_each_chunk(size_t from, size_t to, const ChunkFn& fn) const = 0;
+
+  bool empty() const { return size() == 0; }
+
+  // copies |count| characters starting at |pos|. The cost is proportional to
+  // |count| plus the cost of finding |pos|.
+  std::wstring substr(size_t pos, size_t count) const {
+    std::wstring str;
+    if (pos >= size())
+      return str;
+    count = std::min(count, size() - pos);
+    str.reserve(count);
+    for_each_chunk(pos, pos + count, [&str](size_t, const wchar_t* text, size_t len) {
+      str.append(text, len);
+      return true;
+    });
+    return str;
+  }
+
+  std::wstring to_string() const {
+    return substr(0, size());
+  }
+};
+
+// TextView only talks to the document via this interface so the storage engine
+// can be picked when the view is created. A line is the text up to and including
+// a LF.
+class TextStore : public TextSource {
+public:
+  virtual wchar_t char_at(size_t pos) const = 0;
+  virtual void insert(size_t pos, const wchar_t* text, size_t count) = 0;
+  virtual void erase(size_t pos, size_t count) = 0;
+
+  // returns the number of lines, which is one more than the number of LFs.
+  virtual size_t line_count() const = 0;
+  // returns the offset where line |line| starts, or the size if there are
+  // not that many lines.
+  virtual size_t offset_of_line(size_t line) const = 0;
+  // returns the line that contains |pos|.
+  virtual size_t line_of_offset(size_t pos) const = 0;
+
+  // returns an immutable version of the document. It shares the storage with the
+  // document so making one is O(1), and it can be read from another thread while
+  // the document keeps changing.
+  virtual std::shared_ptr<const TextSource> snapshot() const = 0;
+  // turns the document back into |version|, which must come from snapshot(). The
+  // two only differ in [lo, hi), in the coordinates of the document.
+  virtual void restore(const TextSource& version, size_t lo, size_t hi) = 0;
+
+  // returns the start of the line that contains |pos|.
+  size_t line_start(size_t pos) const {
+    return offset_of_line(line_of_offset(pos));
+  }
+};
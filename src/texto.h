@@ -11,6 +11,12 @@
 
 #pragma once
 #include "stdafx.h"
+#include "piece_table.h"
+#include "rope.h"
+#include "undo.h"
+#include "journal.h"
+#include "text_finder.h"
+#include "word_index.h"
 
 struct Selection {
   size_t begin;
@@ -36,33 +42,11 @@ struct Selection {
   }
 };
 
-struct Ranges {
-  using Tup = std::tuple<size_t, size_t>;
-  std::vector<Tup> items;
-
-  bool empty() const { return items.empty(); }
-
-  void add(size_t start, size_t end) {
-    items.emplace_back(start, end);
-  }
-
-  void clear() { items.clear(); }
-
-  std::vector<Tup> get(size_t start, size_t end) const {
-    auto lb = std::lower_bound(
-        items.begin(), items.end(), start,
-        [](const Tup& tup, size_t s) {
-            return (std::get<0>(tup) < s) && (std::get<1>(tup) < s);
-        });
-    auto ub = std::upper_bound(
-        lb, items.end(), end,
-        [](size_t e, const Tup& tup) {
-            return (e <= std::get<0>(tup));
-        });
-
-    return std::vector<Tup>(lb, ub);
-  }
-};
+std::unique_ptr<TextStore> MakeTextStore(TextStoreKind kind, std::unique_ptr<std::wstring> text) {
+  if (kind == TextStoreKind::rope)
+    return std::make_unique<Rope>(std::move(text));
+  return std::make_unique<PieceTable>(std::move(text));
+}
 
 std::vector<DWRITE_LINE_METRICS> GetDWLineMetrics(IDWriteTextLayout* layout) {
   uint32_t line_count = 0;
@@ -99,17 +83,23 @@ class TextView {
   size_t end_;
   // (one past) the end of the visible text.
   size_t end_view_;
-  // the start and end positions from |full_text_| where |active_text_| was copied from.
-  size_t active_start_;
-  size_t active_end_;
   // the texr range for the interactive selection for copy & paste.
   Selection selection_;
   // The currently found text ranges.
-  Ranges find_ranges_;
-  // stores the text as it should be on disk. If edits are in play it might be incomplete.
-  std::unique_ptr<std::wstring> full_text_;
-  // keeps the active text modifications, it is sort of a "delta" from |full_text_|.
-  std::unique_ptr<std::wstring> active_text_;
+  TextFinder finder_;
+  // where each word is, for select_word() and the statistics.
+  WordIndex words_;
+  // the whole text, see text_store.h.
+  std::unique_ptr<TextStore> document_;
+  // copy of the document from |start_| to |end_|, this is what gets laid out. Edits
+  // go to both so scrolling never has to merge text back into the document.
+  std::wstring view_text_;
+  // the versions of |document_| before and after the current one.
+  UndoHistory history_;
+  // where edits are recorded to survive a crash, not owned.
+  EditJournal* journal_;
+  // the lowest offset changed since take_changed_from(), -1 if none was.
+  size_t changed_from_;
   // the 3 directwrite objects are necessary for layout and rendering.
   plx::ComPtr<IDWriteTextLayout> dwrite_layout_;
   plx::ComPtr<IDWriteFactory> dwrite_factory_;
@@ -122,19 +112,16 @@ class TextView {
 public:
   TextView(plx::ComPtr<IDWriteFactory> dwrite_factory,
            plx::ComPtr<IDWriteTextFormat> dwrite_fmt,
-           std::wstring* text) 
+           std::unique_ptr<TextStore> document)
       : box_(D2D1::SizeF()),
         block_size_(0),
         cursor_(0), cursor_line_(0), cursor_ideal_x_(-1.0f),
         start_(0), end_(0), end_view_(0),
-        active_start_(0), active_end_(0),
+        document_(std::move(document)),
+        journal_(nullptr),
+        changed_from_(size_t(-1)),
         dwrite_factory_(dwrite_factory),
         dwrite_fmt_(dwrite_fmt) {
-    if (text) {
-      full_text_.reset(text);
-    } else {
-      full_text_ = std::make_unique<std::wstring>();
-    }
   }
 
   void set_size(uint32_t width, uint32_t height) {
@@ -146,8 +133,25 @@ public:
     change_view(start_);
   }
 
+  void set_journal(EditJournal* journal) { journal_ = journal; }
+
+  // returns how much of the start of the document is as it was the last time this
+  // was called, and starts counting again from now.
+  size_t take_changed_from() {
+    auto from = std::min(changed_from_, document_->size());
+    changed_from_ = size_t(-1);
+    return from;
+  }
+
+  // the text from |pos| on has to be considered changed again, for example because
+  // saving it failed.
+  void set_changed_from(size_t pos) {
+    changed_from_ = std::min(changed_from_, pos);
+  }
+
   size_t cursor() const { return cursor_; }
   size_t start() const { return start_; }
+  size_t line_count() const { return document_->line_count(); }
 
   void move_cursor_left() {
     if (cursor_ == 0)
@@ -258,68 +262,82 @@ public:
       selection_.end = cursor_ + 1;
     } else {
       // we are at a printable char, expand left and right.
-      auto center = cursor_;
-      std::wstring* str;
-      if (!active_text_) {
-        str = full_text_.get();
-      } else {
-        str = active_text_.get();
-        center -= start_;
-      }
-
       // go left first.
-      auto left = center;
-      while (left != 0) {
-        if (str->at(left) < 0x30)
-          break;
+      auto left = cursor_;
+      while ((left != 0) && WordIndex::is_word_unit(char_at(left - 1)))
         --left;
-      }
       // go right next.
-      auto right = center;
-      while (right != str->size()) {
-        if (str->at(right) < 0x30)
-          break;
+      auto right = cursor_;
+      while ((right != document_->size()) && WordIndex::is_word_unit(char_at(right)))
         ++right;
-      }
 
-      ++left;
       if (left < right) {
-        selection_.begin = active_text_ ? left + start_ : left;
-        selection_.end = active_text_ ? right + start_ : right;
+        selection_.begin = left;
+        selection_.end = right;
       }
     }
 
     cursor_ = selection_.end;
     save_cursor_info();
 
-    // find all the same words.
+    // find all the same words, the index has them once it is built.
     if (selection_.lenght() < 3)
       return;
-    mark_find(get_selection());
+    auto word = get_selection();
+    if ((finder_.mode() == TextFinder::literal) && !words_.started())
+      words_.build(document_->snapshot());
+    if (words_.ready() && (finder_.mode() == TextFinder::literal))
+      finder_.set_words(word, words_.find(*document_, word));
+    else
+      mark_find(word);
   }
 
   std::wstring get_selection() {
     if (selection_.is_empty())
       return std::wstring();
-    merge_active_text();
-    return std::wstring(full_text_->substr(selection_.begin, selection_.lenght()));
+    return document_->substr(selection_.begin, selection_.lenght());
   }
 
+  // the matches in view are found first, the rest arrive through find_progress().
   void mark_find(const std::wstring& text) {
-    find_ranges_.clear();
-    merge_active_text();
-    size_t pos = 0;
-    while (true) {
-      auto x = full_text_->find(text, pos);
-      if (x == std::wstring::npos)
-        break;
-      find_ranges_.add(x, x + text.size());
-      pos = x + 1;
-    }
+    finder_.find(document_->snapshot(), text, start_, end_view_);
+  }
+
+  // |message| is posted to |window| when there are new matches to show.
+  void set_find_notify(HWND window, UINT message) {
+    finder_.set_notify(window, message);
+  }
+
+  // the matches of the previous mode go.
+  void set_find_mode(TextFinder::Mode mode) {
+    finder_.set_mode(mode);
+  }
+
+  // the words are indexed in the background, |message| is posted to |window| when
+  // words_indexed() should be called. Unless |now|, that waits for the first
+  // select_word() that uses the index, indexing a large mapped file decodes all of it.
+  void index_words(HWND window, UINT message, bool now) {
+    words_.set_notify(window, message);
+    if (now)
+      words_.build(document_->snapshot());
+  }
+
+  void words_indexed() {
+    words_.take_build();
+  }
+
+  // 0 until the words are indexed.
+  size_t word_count() {
+    return words_.ready() ? words_.total(*document_) : 0;
+  }
+
+  // returns true if there are new matches.
+  bool find_progress() {
+    return finder_.take_results();
   }
 
   void clear_find() {
-    find_ranges_.clear();
+    finder_.clear();
   }
 
   void v_scroll(int v_offset) {
@@ -345,8 +363,7 @@ public:
   }
 
   void scrollbox_move(float y_fraction) {
-    merge_active_text();
-    size_t target = static_cast<size_t>(full_text_->size() * y_fraction);
+    size_t target = static_cast<size_t>(document_->size() * y_fraction);
     change_view(find_start_above(target));
   }
 
@@ -355,40 +372,48 @@ public:
       // $$ move view to cursor.
       return;
     }
-    make_active_text();
-    active_text_->insert(relative_cursor(), 1, c);
-    ++cursor_;
-    ++end_;
-    invalidate();
+    insert_at_cursor(&c, 1, UndoHistory::typing);
   }
 
   void insert_text(const std::wstring text) {
-    if (text.size() < 512) {
-      make_active_text();
-      active_text_->insert(relative_cursor(), text);
-    } else {
-      merge_active_text();
-      full_text_->insert(cursor_, text);
+    if (cursor_ < start_) {
+      // $$ move view to cursor.
+      return;
     }
-    cursor_ += plx::To<uint32_t>(text.size());
-    end_ += text.size();
-    invalidate();
+    insert_at_cursor(text.c_str(), text.size(), UndoHistory::other);
   }
 
   bool back_erase() {
     if (cursor_ <= 0)
       return false;
-    make_active_text();
     if (!selection_.is_empty()) {
-      active_text_->erase(selection_.get_relative_begin(start_), selection_.lenght());
-      cursor_ = selection_.begin;
+      auto begin = selection_.begin;
+      auto count = selection_.lenght();
+      cursor_ = begin;
       selection_.clear();
+      erase_range(begin, count, UndoHistory::other);
     } else {
       --cursor_;
-      active_text_->erase(relative_cursor(), 1);
-      --end_;
+      erase_range(cursor_, 1, UndoHistory::erasing);
     }
-    invalidate();
+    return true;
+  }
+
+  bool undo() {
+    auto size = document_->size();
+    if (!history_.undo(document_.get(), &cursor_))
+      return false;
+    swapped_version(size);
+    version_changed();
+    return true;
+  }
+
+  bool redo() {
+    auto size = document_->size();
+    if (!history_.redo(document_.get(), &cursor_))
+      return false;
+    swapped_version(size);
+    version_changed();
     return true;
   }
 
@@ -438,9 +463,9 @@ public:
     }
   }
 
-  const std::wstring& get_full_text() {
-    merge_active_text();
-    return *full_text_.get();
+  // see TextStore::snapshot(), this is what gets saved.
+  std::shared_ptr<const TextSource> snapshot() const {
+    return document_->snapshot();
   }
 
 private:
@@ -450,17 +475,13 @@ private:
   }
 
   bool cursor_in_text() {
-    if (!active_text_)
-      return cursor_  < full_text_->size();
-    else
-      return (cursor_ - start_) < active_text_->size();
+    return cursor_ < document_->size();
   }
 
   wchar_t char_at(size_t offset) {
-    if (!active_text_)
-      return full_text_->at(offset);
-    else
-      return active_text_->at(offset - start_);
+    if ((offset >= start_) && (offset - start_ < view_text_.size()))
+      return view_text_[offset - start_];
+    return document_->char_at(offset);
   }
 
   size_t last_position_in_view() {
@@ -470,56 +491,81 @@ private:
   size_t find_previous_nl_start(size_t target) {
     if (!target)
       return 0;
-
-    for (size_t ix = target - 1; ix != 0; --ix) {
-      if ((*full_text_)[ix] == L'\n')
-        return ix + 1;
-    }
-    return 0;
+    return document_->line_start(target);
   }
 
   // we change view when we scroll. |from| is always a line start.
   void change_view(size_t from) {
-    // we always merge the modified text back before scrolling. This can be
-    // expensive if we are talking many MB of text in |full_text_|.
-    merge_active_text();
-    
-    if (from > full_text_->size())
+    if (from > document_->size())
       __debugbreak();
 
     start_ = from;
-    end_ = from + std::min(block_size_, full_text_->size() - from);
+    end_ = from + std::min(block_size_, document_->size() - from);
+    view_text_ = document_->substr(start_, end_ - start_);
     invalidate();
   }
 
-  // the user has made a text modification, we store and layout now from the
-  // |active_text_| until we scroll.
-  void make_active_text() {
-    find_ranges_.clear();
+  // the user has made a text modification. The document and the view text
+  // are changed together, the document cost depends on the number of pieces.
+  void insert_at_cursor(const wchar_t* text, size_t count, UndoHistory::EditKind kind) {
+    history_.will_edit(*document_, kind, cursor_, cursor_);
+    document_->insert(cursor_, text, count);
+    finder_.replaced(*document_, cursor_, 0, count, start_, end_view_);
+    words_.replaced(cursor_, 0, count);
+    changed_from_ = std::min(changed_from_, cursor_);
+    if (journal_)
+      journal_->insert(cursor_, text, count);
+    history_.did_insert(*document_, cursor_, count);
+    view_text_.insert(relative_cursor(), text, count);
+    cursor_ += count;
+    end_ += count;
+    invalidate();
+  }
 
-    if (active_text_)
-      return;
-    // remember the range we copied, which we need to use when we merge.
-    active_start_ = start_;
-    active_end_ = end_;
-    // offset the cursor since are operating on |active_text_|.
-    // slice full_text now.
-    active_text_ = std::make_unique<std::wstring>(
-        full_text_->substr(active_start_, active_end_ - active_start_));
-  }
-
-  // the user is scrolling or saving, we need to have |full_text_| be the sole
-  // source of truth.
-  void merge_active_text() {
-    if (!active_text_)
+  void erase_range(size_t pos, size_t count, UndoHistory::EditKind kind) {
+    history_.will_edit(*document_, kind, pos + count, pos + count);
+    document_->erase(pos, count);
+    finder_.replaced(*document_, pos, count, 0, start_, end_view_);
+    words_.replaced(pos, count, 0);
+    changed_from_ = std::min(changed_from_, pos);
+    if (journal_)
+      journal_->erase(pos, count);
+    history_.did_erase(*document_, pos, count);
+    if (pos < start_) {
+      // the text above the view changed, lay out again from a valid line start.
+      change_view(find_start_above(pos));
       return;
-    if (active_text_->empty())
+    }
+    if (pos - start_ < view_text_.size())
+      view_text_.erase(pos - start_, count);
+    end_ = start_ + view_text_.size();
+    invalidate();
+  }
+
+  // undo and redo replace a span of the document, for the journal that is an
+  // erase and an insert. |old_size| is the size before the swap.
+  void swapped_version(size_t old_size) {
+    size_t lo, hi;
+    history_.swapped_span(&lo, &hi);
+    changed_from_ = std::min(changed_from_, lo);
+    auto inserted = hi + document_->size() - old_size - lo;
+    finder_.replaced(*document_, lo, hi - lo, inserted, start_, end_view_);
+    words_.replaced(lo, hi - lo, inserted);
+    if (!journal_)
       return;
-    // undo the offset done in make_active_text().
-    // This is slow if many MB are stored in |full_text_|. 
-    full_text_->erase(active_start_, active_end_ - active_start_);
-    full_text_->insert(start_, *active_text_);
-    active_text_.reset();
+    journal_->erase(lo, hi - lo);
+    auto text = document_->substr(lo, inserted);
+    journal_->insert(lo, text.c_str(), text.size());
+  }
+
+  // the document is now another version, any part of it could have changed. The
+  // view stays where it was unless the cursor is far from it.
+  void version_changed() {
+    selection_.clear();
+    auto start = std::min(start_, document_->size());
+    if ((cursor_ < start) || (cursor_ > start + block_size_))
+      start = cursor_;
+    change_view(find_start_above(start));
   }
 
   void save_cursor_info() {
@@ -549,15 +595,7 @@ private:
   }
 
   void update_layout() {
-    plx::Range<const wchar_t> txt;
-    if (!active_text_) {
-      // layout from |full_text_|
-      txt = plx::Range<const wchar_t>(&(*full_text_)[0] + start_,
-                                      &(*full_text_)[0] + end_);
-    } else {
-      // layout from |active_text_|
-      txt = plx::Range<const wchar_t>(active_text_->c_str(), active_text_->size());
-    }
+    plx::Range<const wchar_t> txt(view_text_.c_str(), view_text_.size());
     dwrite_layout_ = plx::CreateDWTextLayout(dwrite_factory_, dwrite_fmt_, txt, box_);
     end_view_ = last_position_in_view();
   }
@@ -566,17 +604,18 @@ private:
     dc->DrawTextLayout(D2D1::Point2F(), dwrite_layout_.Get(), text_brush);
 
     // draw boxes on the text from the find set.
-    auto found = find_ranges_.get(start_, end_view_);
+    auto found = finder_.ranges().get(start_, end_view_);
     if (found.empty())
       return;
 
     auto aa_mode = dc->GetAntialiasMode();
     dc->SetAntialiasMode(D2D1_ANTIALIAS_MODE_ALIASED);
 
-    for (auto& item : found) {
+    for (auto item : found) {
       float hm0_height, hm1_height;
+      // a match can start above the view.
       auto p0 = point_from_txtpos(
-          plx::To<uint32_t>(std::get<0>(item) - start_), &hm0_height);
+          plx::To<uint32_t>(std::max(std::get<0>(item), start_) - start_), &hm0_height);
       auto p1 = point_from_txtpos(
           plx::To<uint32_t>(std::get<1>(item) - start_), &hm1_height);
 
@@ -637,7 +676,7 @@ private:
     if ((pt.y < box_.height) && (start_ < 10))
       return;
 
-    if (full_text_->empty())
+    if (document_->empty())
       __debugbreak();
 
     auto aa_mode = dc->GetAntialiasMode();
@@ -651,27 +690,44 @@ private:
                     scroll_box_.x + scroll_width, box_.height),
         brush_gripper, 1.0f);
 
-    auto pos_start = box_.height * float(start_) / float(full_text_->size());
+    auto pos_start = box_.height * float(start_) / float(document_->size());
 
     auto gripper_height = std::max(
         4.0f,
-        ((end_view_ - start_) * box_.height) / full_text_->size());
+        ((end_view_ - start_) * box_.height) / document_->size());
     // view box.
     dc->FillRectangle(
         D2D1::RectF(inset_x, pos_start,
                     scroll_box_.x + scroll_width, pos_start + gripper_height),
         brush_gripper);
 
-    auto pos_curs = box_.height * float(cursor_) / float(full_text_->size());
-
-    // found items.
-    if (!find_ranges_.empty()) {
-      for (auto item : find_ranges_.items) {
-        auto fp = box_.height * float(std::get<0>(item)) / float(full_text_->size());
+    auto pos_curs = box_.height * float(cursor_) / float(document_->size());
+
+    // found items, one mark per pixel row however many land in it. Each row looks
+    // up its first match and the rest are skipped, so with millions of matches the
+    // cost is still per row.
+    auto& ranges = finder_.ranges();
+    auto size = document_->size();
+    int last_row = -1;
+    for (size_t pos = 0; !ranges.empty() && (pos < size); ) {
+      auto span = ranges.get(pos, size);
+      auto it = span.begin();
+      // get() also has the matches that start before |pos| and end after it.
+      while ((it != span.end()) && (it.start() < pos))
+        ++it;
+      if (it == span.end())
+        break;
+      auto fp = box_.height * float(it.start()) / float(size);
+      auto row = static_cast<int>(fp);
+      if (row != last_row) {
         dc->FillRectangle(
             D2D1::RectF(inset_x, fp, scroll_box_.x + scroll_width - 1.0f, fp + 1.0f),
             brush_find);
+        last_row = row;
       }
+      // about where the next row starts.
+      auto next = static_cast<size_t>(double(row + 1) * double(size) / box_.height);
+      pos = std::max(next, it.start() + 1);
     }
 
     // cursor mark.
@@ -801,11 +857,10 @@ private:
   }
 
   size_t find_start_above(size_t target) {
-    merge_active_text();
     auto prev = find_previous_nl_start(target);
-    
-    auto txt = plx::Range<const wchar_t>(&(*full_text_)[prev],
-                                         &(*full_text_)[target + 1]);
+    // only the text of the paragraph above |target| is copied.
+    auto para = document_->substr(prev, target + 1 - prev);
+    auto txt = plx::Range<const wchar_t>(para.c_str(), para.size());
     auto layout = plx::CreateDWTextLayout(dwrite_factory_, dwrite_fmt_, txt, box_);
     auto metrics = GetDWLineMetrics(layout.Get());
 
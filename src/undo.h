@@ -0,0 +1,123 @@
+// TExTO.  Copyright 2014, Carlos Pizano (carlos.pizano@gmail.com)
+// TExTO is a text editor prototype. This is the undo and redo history.
+
+#pragma once
+#include "stdafx.h"
+#include "text_store.h"
+
+// Each entry is a whole version of the document as returned by TextStore::snapshot().
+// Versions share almost all the storage with the document, so an entry costs about
+// what its edits changed, and undo or redo just swap a version back in. Consecutive
+// edits of the same kind that continue where the previous one ended, like typing a
+// word or holding backspace, form a single group with a single entry.
+class UndoHistory {
+public:
+  enum EditKind {
+    typing,     // insert_char().
+    erasing,    // back_erase() of a single character.
+    other       // everything else, never joins a group.
+  };
+
+private:
+  struct Version {
+    std::shared_ptr<const TextSource> text;
+    size_t cursor;
+    // the span of |text| that differs from the version on the other side of it.
+    size_t lo;
+    size_t hi;
+  };
+
+  std::vector<Version> undo_;
+  std::vector<Version> redo_;
+  // the edit that closed the last group and where it left the text.
+  EditKind last_kind_;
+  size_t last_end_;
+  // the span changed by the open group, in the current document.
+  size_t lo_;
+  size_t hi_;
+  // the span the last undo() or redo() replaced, in the document before it.
+  size_t swap_lo_;
+  size_t swap_hi_;
+
+  UndoHistory& operator=(const UndoHistory&) = delete;
+  UndoHistory(const UndoHistory&) = delete;
+
+public:
+  UndoHistory()
+      : last_kind_(other), last_end_(0), lo_(0), hi_(0), swap_lo_(0), swap_hi_(0) {}
+
+  bool can_undo() const { return !undo_.empty(); }
+  bool can_redo() const { return !redo_.empty(); }
+
+  // must be called before |doc| is changed at |pos|. For erases |pos| is where the
+  // erased span ends. |cursor| is restored when the group is undone.
+  void will_edit(const TextStore& doc, EditKind kind, size_t pos, size_t cursor) {
+    redo_.clear();
+    if ((kind != other) && (kind == last_kind_) && (pos == last_end_) && !undo_.empty())
+      return;
+    Version version = { doc.snapshot(), cursor, pos, pos };
+    undo_.push_back(version);
+    last_kind_ = kind;
+    lo_ = pos;
+    hi_ = pos;
+  }
+
+  void did_insert(const TextStore& doc, size_t pos, size_t count) {
+    lo_ = std::min(lo_, pos);
+    hi_ = (pos <= hi_) ? hi_ + count : pos + count;
+    last_end_ = pos + count;
+    update_span(doc);
+  }
+
+  void did_erase(const TextStore& doc, size_t pos, size_t count) {
+    lo_ = std::min(lo_, pos);
+    hi_ = std::max(hi_, pos + count) - count;
+    last_end_ = pos;
+    update_span(doc);
+  }
+
+  // returns false if there is nothing to undo, otherwise |doc| goes back one group
+  // and |cursor| gets where the cursor was before it.
+  bool undo(TextStore* doc, size_t* cursor) {
+    return swap(doc, cursor, &undo_, &redo_);
+  }
+
+  bool redo(TextStore* doc, size_t* cursor) {
+    return swap(doc, cursor, &redo_, &undo_);
+  }
+
+  // after undo() or redo(), [lo, hi) of the document as it was became [lo, hi +
+  // new size - old size) of the document as it is.
+  void swapped_span(size_t* lo, size_t* hi) const {
+    *lo = swap_lo_;
+    *hi = swap_hi_;
+  }
+
+private:
+  // the base of the group changed, |hi_| maps to its coordinates by subtracting
+  // how much the group grew the document.
+  void update_span(const TextStore& doc) {
+    auto& base = undo_.back();
+    base.lo = lo_;
+    base.hi = hi_ + base.text->size() - doc.size();
+  }
+
+  bool swap(TextStore* doc, size_t* cursor,
+            std::vector<Version>* from, std::vector<Version>* to) {
+    if (from->empty())
+      return false;
+    auto version = from->back();
+    from->pop_back();
+    // the text after the span is the same in both, which gives the span in |doc|.
+    auto hi = version.hi + doc->size() - version.text->size();
+    Version current = { doc->snapshot(), *cursor, version.lo, hi };
+    to->push_back(current);
+    doc->restore(*version.text, version.lo, hi);
+    *cursor = version.cursor;
+    swap_lo_ = version.lo;
+    swap_hi_ = hi;
+    // the next edit always starts a new group.
+    last_kind_ = other;
+    return true;
+  }
+};
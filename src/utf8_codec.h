@@ -0,0 +1,377 @@
+// TExTO.  Copyright 2014, Carlos Pizano (carlos.pizano@gmail.com)
+// TExTO is a text editor prototype. This is the UTF-8 <--> UTF-16 transcoder
+// used for file IO.
+
+#pragma once
+#include "stdafx.h"
+
+#if defined(__AVX2__)
+#define PLX_UTF8_AVX2 1
+#include <immintrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define PLX_UTF8_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Unlike plx::UTF16FromUTF8 and plx::UTF8FromUTF16, which call the Win32 APIs twice
+// (length then convert), these make a single pass into a buffer that the caller
+// sizes for the worst case, and they build on any platform. Runs of ASCII, which
+// is almost all of English prose, are converted 16 or 32 bytes at a time with SSE2
+// or AVX2 and everything else goes through the scalar code, which is also the whole
+// implementation when neither is available.
+//
+// In strict mode invalid input throws plx::CodecException. Otherwise each maximal
+// invalid subsequence (UTF-8) or lone surrogate (UTF-16) becomes U+FFFD.
+
+namespace plx {
+
+// what DecodeUTF8StripCR() dropped. Pass the same one for all the blocks of a file.
+struct CRStats {
+  // CRs followed by a LF.
+  size_t crlf;
+  // any other CR.
+  size_t lone_cr;
+  // the last block ended in a CR, the next block decides what it was.
+  bool pending_cr;
+
+  CRStats() : crlf(0), lone_cr(0), pending_cr(false) {}
+};
+
+namespace utf8_internal {
+
+const uint16_t replacement = 0xFFFD;
+
+inline unsigned int TrailingZeros(uint32_t mask) {
+#if defined(_MSC_VER)
+  unsigned long ix;
+  _BitScanForward(&ix, mask);
+  return ix;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+inline bool IsTrail(uint8_t c) {
+  return (c & 0xC0) == 0x80;
+}
+
+inline void ThrowCodec(int line, const uint8_t* start, size_t count) {
+  plx::Range<const uint8_t> bytes(start, std::min(count, size_t(16)));
+  throw plx::CodecException(line, &bytes);
+}
+
+// decodes the sequence at |in| into |out|. Returns how many bytes were consumed
+// and sets |units| to how many UTF-16 units were written. An invalid sequence
+// consumes its longest valid prefix, but at least one byte.
+inline size_t DecodeOne(const uint8_t* in, size_t avail, uint16_t* out,
+                        size_t* units, bool* valid) {
+  uint8_t c0 = in[0];
+  *valid = true;
+  *units = 1;
+  if (c0 < 0x80) {
+    out[0] = c0;
+    return 1;
+  }
+  if ((c0 >= 0xC2) && (c0 <= 0xDF)) {
+    if ((avail >= 2) && IsTrail(in[1])) {
+      out[0] = static_cast<uint16_t>(((c0 & 0x1F) << 6) | (in[1] & 0x3F));
+      return 2;
+    }
+  } else if ((c0 >= 0xE0) && (c0 <= 0xEF)) {
+    // no overlongs and no surrogates.
+    uint8_t lo = (c0 == 0xE0) ? 0xA0 : 0x80;
+    uint8_t hi = (c0 == 0xED) ? 0x9F : 0xBF;
+    if ((avail >= 2) && (in[1] >= lo) && (in[1] <= hi)) {
+      if ((avail >= 3) && IsTrail(in[2])) {
+        out[0] = static_cast<uint16_t>(
+            ((c0 & 0x0F) << 12) | ((in[1] & 0x3F) << 6) | (in[2] & 0x3F));
+        return 3;
+      }
+      out[0] = replacement;
+      *valid = false;
+      return 2;
+    }
+  } else if ((c0 >= 0xF0) && (c0 <= 0xF4)) {
+    // no overlongs and nothing past U+10FFFF.
+    uint8_t lo = (c0 == 0xF0) ? 0x90 : 0x80;
+    uint8_t hi = (c0 == 0xF4) ? 0x8F : 0xBF;
+    if ((avail >= 2) && (in[1] >= lo) && (in[1] <= hi)) {
+      if ((avail >= 3) && IsTrail(in[2])) {
+        if ((avail >= 4) && IsTrail(in[3])) {
+          uint32_t cp = ((c0 & 0x07) << 18) | ((in[1] & 0x3F) << 12) |
+                        ((in[2] & 0x3F) << 6) | (in[3] & 0x3F);
+          cp -= 0x10000;
+          out[0] = static_cast<uint16_t>(0xD800 + (cp >> 10));
+          out[1] = static_cast<uint16_t>(0xDC00 + (cp & 0x3FF));
+          *units = 2;
+          return 4;
+        }
+        out[0] = replacement;
+        *valid = false;
+        return 3;
+      }
+      out[0] = replacement;
+      *valid = false;
+      return 2;
+    }
+  }
+  out[0] = replacement;
+  *valid = false;
+  return 1;
+}
+
+// returns how many leading bytes of the 16 or 32 at |in| are ASCII (and not CR
+// if |stop_at_cr|) and copies the whole vector widened to |out|; only that many
+// units are meaningful.
+template <bool stop_at_cr>
+size_t WidenASCII(const uint8_t* in, size_t avail, uint16_t* out) {
+#if defined(PLX_UTF8_AVX2)
+  if (avail >= 32) {
+    auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+    auto lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v));
+    auto hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), lo);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 16), hi);
+    if (stop_at_cr)
+      v = _mm256_or_si256(v, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+    uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(v));
+    return mask ? TrailingZeros(mask) : 32;
+  }
+#endif
+#if defined(PLX_UTF8_SSE2)
+  if (avail >= 16) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+    auto zero = _mm_setzero_si128();
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_unpacklo_epi8(v, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 8), _mm_unpackhi_epi8(v, zero));
+    if (stop_at_cr)
+      v = _mm_or_si128(v, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+    uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(v));
+    return mask ? TrailingZeros(mask) : 16;
+  }
+#endif
+  size_t ix = 0;
+  for (; (ix != avail) && (ix != 16) && (in[ix] < 0x80); ++ix) {
+    if (stop_at_cr && (in[ix] == '\r'))
+      break;
+    out[ix] = in[ix];
+  }
+  return ix;
+}
+
+// same as WidenASCII() the other way: returns how many leading units of the
+// 16 or 32 at |in| are ASCII (and not LF if |stop_at_lf|) and copies them
+// narrowed to |out|.
+template <bool stop_at_lf>
+size_t NarrowASCII(const uint16_t* in, size_t avail, uint8_t* out) {
+#if defined(PLX_UTF8_AVX2)
+  if (avail >= 32) {
+    auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+    auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 16));
+    auto high = _mm256_set1_epi16(static_cast<short>(0xFF80));
+    auto zero = _mm256_setzero_si256();
+    auto ascii_a = _mm256_cmpeq_epi16(_mm256_and_si256(a, high), zero);
+    auto ascii_b = _mm256_cmpeq_epi16(_mm256_and_si256(b, high), zero);
+    if (stop_at_lf) {
+      auto lf = _mm256_set1_epi16('\n');
+      ascii_a = _mm256_andnot_si256(_mm256_cmpeq_epi16(a, lf), ascii_a);
+      ascii_b = _mm256_andnot_si256(_mm256_cmpeq_epi16(b, lf), ascii_b);
+    }
+    // packus works per 128-bit lane, the permute puts the quadwords back in order.
+    auto bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), bytes);
+    auto flags = _mm256_permute4x64_epi64(_mm256_packs_epi16(ascii_a, ascii_b), 0xD8);
+    uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(flags));
+    return mask ? TrailingZeros(mask) : 32;
+  }
+#endif
+#if defined(PLX_UTF8_SSE2)
+  if (avail >= 16) {
+    auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+    auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 8));
+    auto high = _mm_set1_epi16(static_cast<short>(0xFF80));
+    auto zero = _mm_setzero_si128();
+    auto ascii_a = _mm_cmpeq_epi16(_mm_and_si128(a, high), zero);
+    auto ascii_b = _mm_cmpeq_epi16(_mm_and_si128(b, high), zero);
+    if (stop_at_lf) {
+      auto lf = _mm_set1_epi16('\n');
+      ascii_a = _mm_andnot_si128(_mm_cmpeq_epi16(a, lf), ascii_a);
+      ascii_b = _mm_andnot_si128(_mm_cmpeq_epi16(b, lf), ascii_b);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(a, b));
+    uint32_t mask = ~static_cast<uint32_t>(_mm_movemask_epi8(_mm_packs_epi16(ascii_a, ascii_b)));
+    mask &= 0xFFFF;
+    return mask ? TrailingZeros(mask) : 16;
+  }
+#endif
+  size_t ix = 0;
+  for (; (ix != avail) && (ix != 16) && (in[ix] < 0x80); ++ix) {
+    if (stop_at_lf && (in[ix] == '\n'))
+      break;
+    out[ix] = static_cast<uint8_t>(in[ix]);
+  }
+  return ix;
+}
+
+// the decoder. With |strip_cr| the CRs are dropped and counted in |cr_stats| as
+// they are found, so each byte is only read once.
+template <bool strip_cr>
+size_t Decode(const plx::Range<const uint8_t>& utf8, uint16_t* utf16,
+              bool strict, CRStats* cr_stats) {
+  auto in = utf8.start();
+  auto end = utf8.end();
+  auto out = utf16;
+  if (strip_cr && cr_stats->pending_cr && (in != end)) {
+    ++((*in == '\n') ? cr_stats->crlf : cr_stats->lone_cr);
+    cr_stats->pending_cr = false;
+  }
+  while (in != end) {
+    if (*in < 0x80) {
+      if (strip_cr && (*in == '\r')) {
+        if (++in == end)
+          cr_stats->pending_cr = true;
+        else
+          ++((*in == '\n') ? cr_stats->crlf : cr_stats->lone_cr);
+        continue;
+      }
+      // the vector write can go past what is decoded but never past the room
+      // for the input that is left.
+      auto count = WidenASCII<strip_cr>(in, end - in, out);
+      in += count;
+      out += count;
+      if (count)
+        continue;
+    }
+    size_t units;
+    bool valid;
+    auto consumed = DecodeOne(in, end - in, out, &units, &valid);
+    if (!valid && strict)
+      ThrowCodec(__LINE__, in, end - in);
+    in += consumed;
+    out += units;
+  }
+  return out - utf16;
+}
+
+// the encoder. With |expand_lf| each LF becomes CRLF, found in the same pass.
+template <bool expand_lf>
+size_t Encode(const plx::Range<const uint16_t>& utf16, uint8_t* utf8, bool strict) {
+  auto in = utf16.start();
+  auto end = utf16.end();
+  auto out = utf8;
+  while (in != end) {
+    uint32_t cp = *in;
+    if (cp < 0x80) {
+      if (expand_lf && (cp == '\n')) {
+        *out++ = '\r';
+        *out++ = '\n';
+        ++in;
+        continue;
+      }
+      auto count = NarrowASCII<expand_lf>(in, end - in, out);
+      in += count;
+      out += count;
+      if (count)
+        continue;
+    }
+    ++in;
+    if ((cp >= 0xD800) && (cp <= 0xDFFF)) {
+      if ((cp <= 0xDBFF) && (in != end) && (*in >= 0xDC00) && (*in <= 0xDFFF)) {
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (*in - 0xDC00);
+        ++in;
+      } else if (strict) {
+        auto bytes = reinterpret_cast<const uint8_t*>(in - 1);
+        ThrowCodec(__LINE__, bytes, sizeof(uint16_t));
+      } else {
+        cp = replacement;
+      }
+    }
+    if (cp < 0x800) {
+      *out++ = static_cast<uint8_t>(0xC0 | (cp >> 6));
+      *out++ = static_cast<uint8_t>(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+      *out++ = static_cast<uint8_t>(0xE0 | (cp >> 12));
+      *out++ = static_cast<uint8_t>(0x80 | ((cp >> 6) & 0x3F));
+      *out++ = static_cast<uint8_t>(0x80 | (cp & 0x3F));
+    } else {
+      *out++ = static_cast<uint8_t>(0xF0 | (cp >> 18));
+      *out++ = static_cast<uint8_t>(0x80 | ((cp >> 12) & 0x3F));
+      *out++ = static_cast<uint8_t>(0x80 | ((cp >> 6) & 0x3F));
+      *out++ = static_cast<uint8_t>(0x80 | (cp & 0x3F));
+    }
+  }
+  return out - utf8;
+}
+
+}  // namespace utf8_internal
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::DecodeUTF8
+// utf16 : must have room for utf8.size() units, the most |utf8| can produce.
+// returns the number of units written.
+//
+size_t DecodeUTF8(const plx::Range<const uint8_t>& utf8, uint16_t* utf16, bool strict) {
+  return utf8_internal::Decode<false>(utf8, utf16, strict, nullptr);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::DecodeUTF8StripCR
+// Same as DecodeUTF8 but without the CRs, which are counted in |cr_stats|.
+//
+size_t DecodeUTF8StripCR(const plx::Range<const uint8_t>& utf8, uint16_t* utf16,
+                         bool strict, CRStats* cr_stats) {
+  return utf8_internal::Decode<true>(utf8, utf16, strict, cr_stats);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::EncodeUTF8
+// utf8 : must have room for 3 * utf16.size() bytes, the most |utf16| can produce.
+// returns the number of bytes written.
+//
+size_t EncodeUTF8(const plx::Range<const uint16_t>& utf16, uint8_t* utf8, bool strict) {
+  return utf8_internal::Encode<false>(utf16, utf8, strict);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::EncodeUTF8ExpandLF
+// Same as EncodeUTF8 but each LF is written as CRLF, which still fits in the
+// room for 3 bytes per unit.
+//
+size_t EncodeUTF8ExpandLF(const plx::Range<const uint16_t>& utf16, uint8_t* utf8, bool strict) {
+  return utf8_internal::Encode<true>(utf16, utf8, strict);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::UTF8Length
+// returns the number of bytes EncodeUTF8 writes for |utf16| when not strict, or
+// EncodeUTF8ExpandLF if |expand_lf| is true. Nothing is written.
+//
+size_t UTF8Length(const plx::Range<const uint16_t>& utf16, bool expand_lf) {
+  auto in = utf16.start();
+  auto end = utf16.end();
+  size_t count = 0;
+  while (in != end) {
+    uint32_t cp = *in++;
+    if (cp < 0x80) {
+      count += (expand_lf && (cp == '\n')) ? 2 : 1;
+    } else if (cp < 0x800) {
+      count += 2;
+    } else if ((cp >= 0xD800) && (cp <= 0xDBFF) &&
+               (in != end) && (*in >= 0xDC00) && (*in <= 0xDFFF)) {
+      ++in;
+      count += 4;
+    } else {
+      // lone surrogates are replaced by U+FFFD, also 3 bytes.
+      count += 3;
+    }
+  }
+  return count;
+}
+
+}  // namespace plx
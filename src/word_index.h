@@ -0,0 +1,333 @@
+// TExTO.  Copyright 2014, Carlos Pizano (carlos.pizano@gmail.com)
+// TExTO is a text editor prototype. This is the index of where each word of the
+// document is.
+
+#pragma once
+#include "stdafx.h"
+#include "text_store.h"
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+
+// A word is what select_word() selects: a run of characters from '0' (0x30) up.
+//
+// The document is split in chunks of whole lines of about |chunk_size|. Each chunk
+// has its words as (word id, offset from the chunk start) sorted, so the places of a
+// word are a binary search per chunk, and the counts of all the words are kept for
+// the statistics. An edit only resizes the chunks it touches and marks them and the
+// next one stale, the next lookup indexes the stale chunks again, so typing costs
+// nothing until then and then about two chunks. Every chunk but the last ends with
+// a LF, which is why an edit can only join words with the next chunk.
+//
+// The first index is built in a thread over a snapshot and the window is told with
+// |message_| to call take_build(). The edits made meanwhile are kept and applied to
+// it then.
+class WordIndex {
+  struct Chunk {
+    size_t size;
+    bool stale;
+    // (word id, offset) sorted. Stale chunks keep the words they had to take them
+    // out of the counts.
+    std::vector<std::pair<uint32_t, uint32_t>> words;
+  };
+
+  struct Word {
+    std::wstring text;
+    size_t count;
+  };
+
+  struct Contents {
+    std::unordered_map<std::wstring, uint32_t> ids;
+    // indexed by id. Words that are gone stay with count 0.
+    std::vector<Word> words;
+    std::vector<Chunk> chunks;
+    size_t total;
+    bool stale;
+  };
+
+  struct Edit {
+    size_t pos;
+    size_t erased;
+    size_t inserted;
+  };
+
+  Contents contents_;
+  // true once |contents_| has the whole document.
+  bool ready_;
+  // the build in progress, its result and the edits it does not have.
+  std::thread thread_;
+  std::atomic<bool> cancel_;
+  std::atomic<bool> done_;
+  std::unique_ptr<Contents> built_;
+  std::vector<Edit> pending_;
+  bool building_;
+  HWND window_;
+  UINT message_;
+
+  WordIndex& operator=(const WordIndex&) = delete;
+  WordIndex(const WordIndex&) = delete;
+
+public:
+  static const size_t chunk_size = 16 * 1024;
+
+  WordIndex()
+      : ready_(false), cancel_(false), done_(false), building_(false),
+        window_(nullptr), message_(0) {
+    contents_.total = 0;
+    contents_.stale = false;
+  }
+
+  ~WordIndex() {
+    cancel_ = true;
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+  static bool is_word_unit(wchar_t c) {
+    return c >= 0x30;
+  }
+
+  bool ready() const { return ready_; }
+  // true once build() was called.
+  bool started() const { return ready_ || building_; }
+
+  // who gets told when the build is done. Without a window it is synchronous.
+  void set_notify(HWND window, UINT message) {
+    window_ = window;
+    message_ = message;
+  }
+
+  // indexes |text|.
+  void build(std::shared_ptr<const TextSource> text) {
+    building_ = true;
+    if (!window_) {
+      built_ = index_all(*text);
+      take_build();
+      return;
+    }
+    thread_ = std::thread([this, text]() {
+      built_ = index_all(*text);
+      done_ = true;
+      if (!cancel_)
+        ::PostMessageW(window_, message_, 0, 0);
+    });
+  }
+
+  // if the build is done, from now on the index follows the edits.
+  void take_build() {
+    if (thread_.joinable()) {
+      if (!done_)
+        return;
+      thread_.join();
+    }
+    if (!built_)
+      return;
+    std::swap(contents_, *built_);
+    built_.reset();
+    building_ = false;
+    ready_ = true;
+    for (auto& edit : pending_)
+      replaced(edit.pos, edit.erased, edit.inserted);
+    pending_.clear();
+  }
+
+  // [pos, pos + erased) of the text became |inserted| characters.
+  void replaced(size_t pos, size_t erased, size_t inserted) {
+    if (building_) {
+      Edit edit = { pos, erased, inserted };
+      pending_.push_back(edit);
+      return;
+    }
+    if (!ready_)
+      return;
+    auto& chunks = contents_.chunks;
+    contents_.stale = true;
+    if (chunks.empty()) {
+      Chunk chunk = { inserted, true };
+      chunks.push_back(chunk);
+      return;
+    }
+    // the inserted text goes to the chunk that has |pos|, or the last one.
+    size_t ix = 0;
+    size_t start = 0;
+    while ((ix + 1 != chunks.size()) && (start + chunks[ix].size <= pos))
+      start += chunks[ix++].size;
+    auto first = ix;
+    // the erased text can span several chunks.
+    for (auto at = pos - start; erased; at = 0) {
+      auto& chunk = chunks[ix++];
+      auto count = std::min(erased, chunk.size - at);
+      chunk.size -= count;
+      chunk.stale = true;
+      erased -= count;
+    }
+    chunks[first].size += inserted;
+    chunks[first].stale = true;
+    // the LF that ended the last chunk could be gone.
+    auto next = std::max(first + 1, ix);
+    if (next < chunks.size())
+      chunks[next].stale = true;
+  }
+
+  // the start of each |word| in |text|, which must be the document after all the
+  // edits given to replaced().
+  std::vector<size_t> find(const TextSource& text, const std::wstring& word) {
+    std::vector<size_t> starts;
+    update(text);
+    auto it = contents_.ids.find(word);
+    if ((it == contents_.ids.end()) || !contents_.words[it->second].count)
+      return starts;
+    auto id = it->second;
+    starts.reserve(contents_.words[id].count);
+    size_t start = 0;
+    for (auto& chunk : contents_.chunks) {
+      auto range = std::equal_range(chunk.words.begin(), chunk.words.end(),
+                                    std::make_pair(id, uint32_t(0)),
+                                    [](const std::pair<uint32_t, uint32_t>& a,
+                                       const std::pair<uint32_t, uint32_t>& b) {
+        return a.first < b.first;
+      });
+      for (auto w = range.first; w != range.second; ++w)
+        starts.push_back(start + w->second);
+      start += chunk.size;
+    }
+    return starts;
+  }
+
+  // all the words in |text|, repeated ones each time.
+  size_t total(const TextSource& text) {
+    update(text);
+    return contents_.total;
+  }
+
+  size_t count(const TextSource& text, const std::wstring& word) {
+    update(text);
+    auto it = contents_.ids.find(word);
+    return (it == contents_.ids.end()) ? 0 : contents_.words[it->second].count;
+  }
+
+  // the |max| words that appear the most and how many times.
+  std::vector<std::pair<std::wstring, size_t>> most_frequent(const TextSource& text, size_t max) {
+    update(text);
+    std::vector<const Word*> words;
+    for (auto& word : contents_.words) {
+      if (word.count)
+        words.push_back(&word);
+    }
+    auto top = std::min(max, words.size());
+    std::partial_sort(words.begin(), words.begin() + top, words.end(),
+                      [](const Word* a, const Word* b) { return a->count > b->count; });
+    std::vector<std::pair<std::wstring, size_t>> frequent;
+    for (size_t ix = 0; ix != top; ++ix)
+      frequent.emplace_back(words[ix]->text, words[ix]->count);
+    return frequent;
+  }
+
+private:
+  // indexes the stale chunks again.
+  void update(const TextSource& text) {
+    if (!ready_ || !contents_.stale)
+      return;
+    auto& old = contents_.chunks;
+    std::vector<Chunk> chunks;
+    size_t start = 0;
+    for (size_t ix = 0; ix != old.size(); ) {
+      if (!old[ix].stale) {
+        start += old[ix].size;
+        chunks.push_back(std::move(old[ix++]));
+        continue;
+      }
+      // consecutive stale chunks are indexed again together.
+      auto end = start;
+      for (; (ix != old.size()) && old[ix].stale; ++ix) {
+        for (auto& w : old[ix].words)
+          --contents_.words[w.first].count;
+        contents_.total -= old[ix].words.size();
+        end += old[ix].size;
+      }
+      index_span(text, start, end, &contents_, &chunks);
+      start = end;
+    }
+    old.swap(chunks);
+    contents_.stale = false;
+  }
+
+  std::unique_ptr<Contents> index_all(const TextSource& text) {
+    auto contents = std::make_unique<Contents>();
+    contents->total = 0;
+    contents->stale = false;
+    size_t size = text.size();
+    for (size_t start = 0; (start < size) && !cancel_; ) {
+      auto end = next_line(text, std::min(start + chunk_size, size));
+      index_span(text, start, end, contents.get(), &contents->chunks);
+      start = end;
+    }
+    return contents;
+  }
+
+  // the first line start at or after |pos|, or the size of the text.
+  static size_t next_line(const TextSource& text, size_t pos) {
+    if (!pos)
+      return 0;
+    auto next = text.size();
+    text.for_each_chunk(pos - 1, next, [&next](size_t offset, const wchar_t* chunk, size_t len) {
+      auto lf = std::find(chunk, chunk + len, L'\n');
+      if (lf == chunk + len)
+        return true;
+      next = offset + (lf - chunk) + 1;
+      return false;
+    });
+    return next;
+  }
+
+  // adds the chunks for [from, to), which starts at a line start and ends at one or
+  // at the end of the text, cut after the first LF past each |chunk_size|.
+  void index_span(const TextSource& text, size_t from, size_t to,
+                  Contents* contents, std::vector<Chunk>* chunks) const {
+    if (from == to)
+      return;
+    auto span = text.substr(from, to - from);
+    size_t start = 0;
+    do {
+      auto end = span.size();
+      if (end - start > chunk_size) {
+        auto lf = span.find(L'\n', start + chunk_size);
+        if (lf != std::wstring::npos)
+          end = lf + 1;
+      }
+      Chunk chunk = { end - start, false };
+      index_words(span.c_str() + start, end - start, contents, &chunk);
+      chunks->push_back(std::move(chunk));
+      start = end;
+    } while (start != span.size());
+  }
+
+  static void index_words(const wchar_t* text, size_t len, Contents* contents, Chunk* chunk) {
+    for (size_t ix = 0; ix != len; ) {
+      if (!is_word_unit(text[ix])) {
+        ++ix;
+        continue;
+      }
+      auto start = ix;
+      while ((ix != len) && is_word_unit(text[ix]))
+        ++ix;
+      std::wstring word(text + start, ix - start);
+      auto it = contents->ids.find(word);
+      uint32_t id;
+      if (it == contents->ids.end()) {
+        id = static_cast<uint32_t>(contents->words.size());
+        contents->ids.emplace(word, id);
+        Word entry = { std::move(word), 0 };
+        contents->words.push_back(std::move(entry));
+      } else {
+        id = it->second;
+      }
+      ++contents->words[id].count;
+      chunk->words.emplace_back(id, static_cast<uint32_t>(start));
+    }
+    contents->total += chunk->words.size();
+    std::sort(chunk->words.begin(), chunk->words.end());
+  }
+};
+
+const size_t WordIndex::chunk_size;
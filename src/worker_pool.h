@@ -0,0 +1,94 @@
+// TExTO.  Copyright 2014, Carlos Pizano (carlos.pizano@gmail.com)
+// TExTO is a text editor prototype. This is the pool of threads that runs work
+// in parallel.
+
+#pragma once
+#include "stdafx.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// A fixed number of threads that run the tasks given to post() in the order they
+// were posted. wait() returns when all of them are done, so the typical use is to
+// post a batch, wait and use the results. With no threads post() runs the task
+// right there, which is what small jobs want anyway.
+//
+// Tasks must not throw.
+class WorkerPool {
+  std::vector<std::thread> threads_;
+  std::mutex lock_;
+  std::condition_variable work_ready_;
+  std::condition_variable work_done_;
+  std::deque<std::function<void()>> queue_;
+  // tasks posted and not finished.
+  size_t pending_;
+  bool exit_;
+
+  WorkerPool& operator=(const WorkerPool&) = delete;
+  WorkerPool(const WorkerPool&) = delete;
+
+public:
+  explicit WorkerPool(size_t count) : pending_(0), exit_(false) {
+    for (size_t ix = 0; ix != count; ++ix)
+      threads_.emplace_back([this]() { run(); });
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      exit_ = true;
+    }
+    work_ready_.notify_all();
+    for (auto& thread : threads_)
+      thread.join();
+  }
+
+  // a reasonable number of threads to use, up to |max|, leaving one core for the UI.
+  static size_t default_size(size_t max = 4) {
+    size_t cores = std::thread::hardware_concurrency();
+    return (cores > 1) ? std::min(cores - 1, max) : 0;
+  }
+
+  size_t size() const { return threads_.size(); }
+
+  void post(const std::function<void()>& task) {
+    if (threads_.empty()) {
+      task();
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      queue_.push_back(task);
+      ++pending_;
+    }
+    work_ready_.notify_one();
+  }
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(lock_);
+    work_done_.wait(lock, [this]() { return pending_ == 0; });
+  }
+
+private:
+  void run() {
+    for (;;) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(lock_);
+        work_ready_.wait(lock, [this]() { return exit_ || !queue_.empty(); });
+        if (queue_.empty())
+          return;
+        task = std::move(queue_.front());
+        queue_.pop_front();
+      }
+      task();
+      {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (--pending_ == 0)
+          work_done_.notify_all();
+      }
+    }
+  }
+};